@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rw_epoch.h"
+#include "rw_locks.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* Reclaim the retired versions when this many of them are pending */
+#define RW_EPOCH_RECLAIM_THRESHOLD 64
+
+/*
+ * The epoch a reader observed when it entered its section, or zero
+ * outside of the sections. Each reader has its own cache line.
+ */
+struct rw_epoch_reader {
+    uint64_t epoch;
+    /* Depth of the nested sections */
+    unsigned int nesting;
+    bool in_use;
+    rw_epoch_domain *domain;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * Version retired by rw_epoch_defer(), which can be freed once all the
+ * readers have observed any epoch after 'epoch'.
+ */
+typedef struct rw_epoch_retired {
+    void *ptr;
+    rw_epoch_free_cb cb;
+    void *arg;
+    uint64_t epoch;
+    struct rw_epoch_retired *next;
+} rw_epoch_retired;
+
+struct rw_epoch_domain {
+    /* Advanced by the writers, and read by the readers entering a section */
+    uint64_t global_epoch __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int readers_no;
+    rw_epoch_reader *readers;
+    /* FIFO of the retired versions, in the order of their epochs */
+    pthread_mutex_t retired_mutex;
+    rw_epoch_retired *retired_head;
+    rw_epoch_retired *retired_tail;
+    unsigned int retired_no;
+};
+
+/*
+ * Create a domain for up to 'thread_total_no' registered readers.
+ */
+rw_epoch_domain *
+rw_epoch_init(unsigned int thread_total_no){
+    rw_epoch_domain *domain;
+    void *mem;
+    int i;
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(rw_epoch_domain)) != 0){
+	perror("posix_memalign");
+	exit(-1);
+    }
+    domain = (rw_epoch_domain *) mem;
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE,
+		       sizeof(rw_epoch_reader) * thread_total_no) != 0){
+	perror("posix_memalign");
+	exit(-1);
+    }
+    domain->readers = (rw_epoch_reader *) mem;
+    domain->readers_no = thread_total_no;
+
+    for (i = 0; i < thread_total_no; i++){
+	domain->readers[i].epoch = 0;
+	domain->readers[i].nesting = 0;
+	domain->readers[i].in_use = false;
+	domain->readers[i].domain = domain;
+    }
+
+    /* Zero is reserved for the readers outside of the sections */
+    domain->global_epoch = 1;
+
+    if (pthread_mutex_init(&domain->retired_mutex, NULL) != 0){
+	perror("pthread_mutex_init");
+	exit(-1);
+    }
+    domain->retired_head = NULL;
+    domain->retired_tail = NULL;
+    domain->retired_no = 0;
+
+    return domain;
+}
+
+/*
+ * Take a free reader record for the calling thread. Each thread reading the
+ * data of 'domain' registers once, and passes the record to rw_epoch_enter()
+ * and rw_epoch_exit().
+ */
+rw_epoch_reader *
+rw_epoch_register(rw_epoch_domain *domain){
+    bool expected;
+    int i;
+
+    for (i = 0; i < domain->readers_no; i++){
+	expected = false;
+	if (__atomic_compare_exchange_n(&domain->readers[i].in_use, &expected, true,
+					false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    return &domain->readers[i];
+    }
+
+    /* There are more readers than 'thread_total_no' */
+    my_assert(NULL, __FILE__, __LINE__, 0);
+
+    return NULL;
+}
+
+void
+rw_epoch_unregister(rw_epoch_reader *reader){
+    my_assert(NULL, __FILE__, __LINE__, reader->nesting == 0);
+
+    __atomic_store_n(&reader->in_use, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Enter the read-side section. The sections may nest.
+ */
+void
+rw_epoch_enter(rw_epoch_reader *reader){
+    if (reader->nesting++ > 0)
+	return;
+
+    __atomic_store_n(&reader->epoch,
+		     __atomic_load_n(&reader->domain->global_epoch, __ATOMIC_RELAXED),
+		     __ATOMIC_RELAXED);
+    /*
+     * Announce the epoch before loading any version. Pairs with the scan of
+     * the readers in rw_epoch_wait_readers() and rw_epoch_oldest().
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+rw_epoch_exit(rw_epoch_reader *reader){
+    my_assert(NULL, __FILE__, __LINE__, reader->nesting > 0);
+
+    if (--reader->nesting > 0)
+	return;
+
+    /* The reads of the version complete before leaving the section */
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Load the current version in 'slot'. Valid until rw_epoch_exit().
+ */
+void *
+rw_epoch_dereference(void **slot){
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Replace the version in 'slot' by 'new_version' and return the old one.
+ * The writers serialize by the write lock of the rw_lock protecting 'slot'.
+ */
+void *
+rw_epoch_publish(void **slot, void *new_version){
+    return __atomic_exchange_n(slot, new_version, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait until every reader in its section has observed 'epoch' or later.
+ */
+static void
+rw_epoch_wait_readers(rw_epoch_domain *domain, uint64_t epoch){
+    uint64_t observed;
+    int i;
+
+    for (i = 0; i < domain->readers_no; i++){
+	while((observed = __atomic_load_n(&domain->readers[i].epoch,
+					  __ATOMIC_SEQ_CST)) != 0 &&
+	      observed < epoch)
+	    sched_yield();
+    }
+}
+
+/*
+ * Return the oldest epoch which may be observed by the readers now.
+ */
+static uint64_t
+rw_epoch_oldest(rw_epoch_domain *domain){
+    uint64_t oldest, observed;
+    int i;
+
+    /* A reader entering after this load observes this epoch or later */
+    oldest = __atomic_load_n(&domain->global_epoch, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < domain->readers_no; i++){
+	observed = __atomic_load_n(&domain->readers[i].epoch, __ATOMIC_SEQ_CST);
+	if (observed != 0 && observed < oldest)
+	    oldest = observed;
+    }
+
+    return oldest;
+}
+
+/*
+ * Wait until all the readers which might see a version unpublished before
+ * this call leave their sections. Must not be called in a read-side section.
+ */
+void
+rw_epoch_synchronize(rw_epoch_domain *domain){
+    rw_epoch_wait_readers(domain,
+			  __atomic_add_fetch(&domain->global_epoch, 1, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * Call the callbacks of the retired versions in 'retired' and free the list.
+ */
+static void
+rw_epoch_free_retired(rw_epoch_retired *retired){
+    rw_epoch_retired *next;
+
+    while(retired != NULL){
+	next = retired->next;
+	retired->cb(retired->ptr, retired->arg);
+	free(retired);
+	retired = next;
+    }
+}
+
+/*
+ * Free the retired versions no reader can see any more. When 'wait' is true,
+ * wait for the readers to leave, so that all the versions retired before
+ * this call are freed.
+ */
+void
+rw_epoch_reclaim(rw_epoch_domain *domain, bool wait){
+    rw_epoch_retired *ready_head = NULL, *ready_tail = NULL;
+    uint64_t safe_epoch;
+
+    if (wait){
+	safe_epoch = __atomic_add_fetch(&domain->global_epoch, 1, __ATOMIC_SEQ_CST);
+	rw_epoch_wait_readers(domain, safe_epoch);
+    }else{
+	safe_epoch = rw_epoch_oldest(domain);
+    }
+
+    pthread_mutex_lock(&domain->retired_mutex);
+    while(domain->retired_head != NULL &&
+	  domain->retired_head->epoch < safe_epoch){
+	if (ready_tail == NULL)
+	    ready_head = domain->retired_head;
+	else
+	    ready_tail->next = domain->retired_head;
+	ready_tail = domain->retired_head;
+
+	domain->retired_head = domain->retired_head->next;
+	domain->retired_no--;
+    }
+    if (domain->retired_head == NULL)
+	domain->retired_tail = NULL;
+    if (ready_tail != NULL)
+	ready_tail->next = NULL;
+    pthread_mutex_unlock(&domain->retired_mutex);
+
+    /* The callbacks may retire other versions */
+    rw_epoch_free_retired(ready_head);
+}
+
+/*
+ * Retire 'ptr' unpublished from the readers, and let 'cb' free it once no
+ * reader can see it. Doesn't wait for the readers. The pending versions are
+ * reclaimed every RW_EPOCH_RECLAIM_THRESHOLD retirements, and by
+ * rw_epoch_reclaim().
+ */
+void
+rw_epoch_defer(rw_epoch_domain *domain, void *ptr,
+	       rw_epoch_free_cb cb, void *arg){
+    rw_epoch_retired *retired;
+    bool reclaim;
+
+    if ((retired = (rw_epoch_retired *) malloc(sizeof(rw_epoch_retired))) == NULL){
+	perror("malloc");
+	exit(-1);
+    }
+
+    retired->ptr = ptr;
+    retired->cb = cb;
+    retired->arg = arg;
+    retired->next = NULL;
+
+    pthread_mutex_lock(&domain->retired_mutex);
+    /*
+     * The readers which observe a later epoch enter their sections after
+     * 'ptr' has been unpublished
+     */
+    retired->epoch = __atomic_fetch_add(&domain->global_epoch, 1, __ATOMIC_SEQ_CST);
+    if (domain->retired_tail == NULL)
+	domain->retired_head = retired;
+    else
+	domain->retired_tail->next = retired;
+    domain->retired_tail = retired;
+    reclaim = ++domain->retired_no >= RW_EPOCH_RECLAIM_THRESHOLD;
+    pthread_mutex_unlock(&domain->retired_mutex);
+
+    if (reclaim)
+	rw_epoch_reclaim(domain, false);
+}
+
+/*
+ * Free all the pending versions and the domain. No reader may be in its
+ * section.
+ */
+void
+rw_epoch_destroy(rw_epoch_domain *domain){
+    int i;
+
+    for (i = 0; i < domain->readers_no; i++){
+	my_assert(NULL, __FILE__, __LINE__,
+		  domain->readers[i].nesting == 0);
+    }
+
+    rw_epoch_reclaim(domain, true);
+    my_assert(NULL, __FILE__, __LINE__,
+	      domain->retired_head == NULL);
+
+    pthread_mutex_destroy(&domain->retired_mutex);
+    free(domain->readers);
+    free(domain);
+}
@@ -0,0 +1,64 @@
+#ifndef __RW_EPOCH__
+#define __RW_EPOCH__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Epoch-based reclamation for the read-mostly data behind a rw_lock.
+ *
+ * The readers don't take the lock. They enter an epoch section, load the
+ * current version by rw_epoch_dereference() and only read it. The writers
+ * still serialize by rw_lock_wr_lock(), publish a new version by
+ * rw_epoch_publish(), and retire the old one either by rw_epoch_synchronize()
+ * followed by the free, or by rw_epoch_defer(). The old version is freed
+ * after all the readers which might see it have left their sections.
+ *
+ *   reader:                                 writer:
+ *     rw_epoch_enter(reader);                 rw_lock_wr_lock(rwl);
+ *     cfg = rw_epoch_dereference(&slot);      old = rw_epoch_publish(&slot, new);
+ *     ... read cfg ...                        rw_lock_unlock(rwl);
+ *     rw_epoch_exit(reader);                  rw_epoch_defer(domain, old, free_cb, NULL);
+ *
+ * A reader only writes to its own cache line, so the read path makes no
+ * shared write.
+ */
+typedef struct rw_epoch_domain rw_epoch_domain;
+
+/*
+ * Per-thread record of a reader, returned by rw_epoch_register().
+ */
+typedef struct rw_epoch_reader rw_epoch_reader;
+
+/*
+ * Called to free 'ptr' retired by rw_epoch_defer(), once no reader can
+ * see it. Runs in the thread reclaiming the retired versions.
+ */
+typedef void (*rw_epoch_free_cb)(void *ptr, void *arg);
+
+rw_epoch_domain *rw_epoch_init(unsigned int thread_total_no);
+void rw_epoch_destroy(rw_epoch_domain *domain);
+
+/* Readers */
+rw_epoch_reader *rw_epoch_register(rw_epoch_domain *domain);
+void rw_epoch_unregister(rw_epoch_reader *reader);
+void rw_epoch_enter(rw_epoch_reader *reader);
+void rw_epoch_exit(rw_epoch_reader *reader);
+void *rw_epoch_dereference(void **slot);
+
+/* Writers */
+void *rw_epoch_publish(void **slot, void *new_version);
+void rw_epoch_synchronize(rw_epoch_domain *domain);
+void rw_epoch_defer(rw_epoch_domain *domain, void *ptr,
+		    rw_epoch_free_cb cb, void *arg);
+void rw_epoch_reclaim(rw_epoch_domain *domain, bool wait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,22 +1,156 @@
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "rw_locks.h"
 
 /* Turn on the self debug assertion for more advanced tests */
 #define DEBUG_RW_LOCK
 
+/*
+ * Static tracepoints (USDT) of the provider "rw_lock" for bpftrace and the
+ * like. A probe is a nop instruction until a tracer attaches to it. They
+ * are compiled out when <sys/sdt.h> is missing or RW_LOCK_NO_PROBES is
+ * defined.
+ *
+ * acquire_start   (rwl, mode, owner)
+ * acquire_granted (rwl, mode, owner, depth, waiting readers, waiting writers)
+ * acquire_failed  (rwl, mode, owner)
+ * wait            (rwl, mode, owner, waiting readers, waiting writers)
+ * wake            (rwl, mode, owner)
+ * release         (rwl, mode, owner, depth, waiting readers, waiting writers)
+ * wakeup          (rwl, broadcast, waiting readers, waiting writers)
+ *
+ * 'mode' is rw_lock_mode and 'depth' is the recursion depth of the owner
+ * after the operation.
+ */
+#if !defined(RW_LOCK_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RW_LOCK_PROBES
+#endif
+#endif
+
+#ifdef RW_LOCK_PROBES
+#define RW_LOCK_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(rw_lock, name, a1, a2, a3)
+#define RW_LOCK_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(rw_lock, name, a1, a2, a3, a4)
+#define RW_LOCK_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(rw_lock, name, a1, a2, a3, a4, a5)
+#define RW_LOCK_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+    DTRACE_PROBE6(rw_lock, name, a1, a2, a3, a4, a5, a6)
+#else
+#define RW_LOCK_PROBE3(name, a1, a2, a3) do {} while(0)
+#define RW_LOCK_PROBE4(name, a1, a2, a3, a4) do {} while(0)
+#define RW_LOCK_PROBE5(name, a1, a2, a3, a4, a5) do {} while(0)
+#define RW_LOCK_PROBE6(name, a1, a2, a3, a4, a5, a6) do {} while(0)
+#endif
+
+/*
+ * Probe of the readers in the shards, which read the waiter counts without
+ * the state mutex. That's harmless for the tracing.
+ */
+#define RW_LOCK_SHARD_PROBE(name, rwl, owner, depth) \
+    RW_LOCK_PROBE6(name, rwl, RW_LOCK_READ, owner, depth, \
+		   __atomic_load_n(&(rwl)->waiting_reader_threads, __ATOMIC_RELAXED), \
+		   __atomic_load_n(&(rwl)->waiting_writer_threads, __ATOMIC_RELAXED))
+
+/*
+ * Parameters of the adaptive mode. Judge the read/write mix for every
+ * window of lock acquisitions. Switch to the distributed mode when the
+ * reads are more than the upper ratio and the readers often share the
+ * lock, and switch back when the reads fall below the lower ratio.
+ */
+#define RW_LOCK_SHARDS_NO 8
+#define RW_LOCK_ADAPT_WINDOW 1024
+#define RW_LOCK_ADAPT_DISTRIBUTED_READ_PCT 90
+#define RW_LOCK_ADAPT_CENTRALIZED_READ_PCT 80
+
+/*
+ * Shape of the SNZI tree over the shards. Every RW_LOCK_SNZI_FANOUT shards
+ * share an inner node, and all the inner nodes share the root.
+ */
+#define RW_LOCK_SNZI_FANOUT 4
+#define RW_LOCK_SNZI_INNER_NO (RW_LOCK_SHARDS_NO / RW_LOCK_SNZI_FANOUT)
+
+/*
+ * The state of an inner node packs its version in the upper half and its
+ * surplus in the lower half. The surplus is counted in halves, so that an
+ * arrival announcing the node to the parent can be distinguished.
+ */
+#define RW_LOCK_SNZI_HALF 1
+#define RW_LOCK_SNZI_ONE 2
+#define RW_LOCK_SNZI_SURPLUS(state) ((uint32_t) (state))
+#define RW_LOCK_SNZI_VERSION(state) ((uint32_t) ((state) >> 32))
+#define RW_LOCK_SNZI_STATE(surplus, version) \
+    (((uint64_t) (version) << 32) | (uint32_t) (surplus))
+
+#define CACHE_LINE_SIZE 64
+
+/* Default number of the locks carved from one slab of a rw_lock_pool */
+#define RW_LOCK_POOL_SLAB_LOCKS_NO 64
+
+/*
+ * Node of the scalable non-zero indicator (SNZI) of the readers in the
+ * shards. The shards are the leaves of the tree. A node is non-zero while
+ * any node below it is non-zero, and only the transitions between zero and
+ * non-zero are propagated to the parent. So the readers mostly update their
+ * own shards, and a writer learns the presence of the readers from the root
+ * alone.
+ *
+ * The root is a plain counter of the non-zero inner nodes.
+ */
+typedef struct rw_lock_snzi_node {
+    uint64_t state;
+    struct rw_lock_snzi_node *parent;
+} __attribute__((aligned(CACHE_LINE_SIZE))) rw_lock_snzi_node;
+
+/*
+ * Reader tracking of the distributed mode. A reader takes the lock via the
+ * shard selected by its owner, so that readers with different owners
+ * mostly update different cache lines.
+ */
+typedef struct rw_lock_reader_shard {
+    /* Protect 'readers' and 'manager' */
+    pthread_spinlock_t lock;
+    /* Number of the owners holding the read lock via this shard */
+    unsigned int readers;
+    /* Parent of this shard in the SNZI tree */
+    rw_lock_snzi_node *node;
+    /* Number of the read locks taken via this shard in the adaptive window */
+    unsigned int reads;
+    rec_rdt_manager manager;
+} __attribute__((aligned(CACHE_LINE_SIZE))) rw_lock_reader_shard;
+
+/*
+ * Reader waiting for a free slot of the lock with 'max_readers', queued on
+ * its own stack in FIFO order. Only the head of the FIFO may take the lock,
+ * so each reader sleeps on its own condition variable to be woken alone.
+ */
+typedef struct rw_lock_capped_reader {
+    pthread_cond_t cv;
+    struct rw_lock_capped_reader *next;
+} rw_lock_capped_reader;
+
+static rw_lock_waiter *rw_lock_grant_async_waiters(rw_lock *rwl);
+static void rw_lock_notify_async_waiters(rw_lock *rwl, rw_lock_waiter *granted);
+static void rw_lock_notify_drained(rw_lock *rwl);
+static int rw_lock_class_lookup(const char *name);
+
 /*
  * Raise the SIGUSR1 signal to notify the application bug.
  *
  * Exported so as to be utilized by the application side of this rw_lock library.
  */
 void
-my_assert(char *description, char *filename, int lineno, int expr){
+my_assert(const char *description, const char *filename, int lineno, int expr){
 #ifdef DEBUG_RW_LOCK
     /* Raise the assertion failure if the 'expr' is equal to zero */
     if (expr == 0){
@@ -27,205 +161,1870 @@ my_assert(char *description, char *filename, int lineno, int expr){
 	}
 	raise(SIGUSR1);
     }
-#else
-    assert(expr);
-#endif
+#else
+    assert(expr);
+#endif
+}
+
+/*
+ * Find the index of 'owner' from the reader thread manager.
+ *
+ * On failure, return -1.
+ */
+static int
+rw_lock_get_reader_index(rec_rdt_manager *manager, rw_lock_owner owner){
+    int index;
+
+    for (index = 0; index < manager->insert_index; index++){
+	if (manager->reader_thread_ids[index] == owner){
+	    return index;
+	}
+    }
+
+    return -1;
+}
+
+/*
+ * Pick up an unused entry of the reader thread manager for a new reader.
+ *
+ * Use the never-used entries first, then recycle the entries whose readers
+ * have released all their locks. The latter is required for the asynchronous
+ * requests, since their owner tokens can be more than the threads.
+ */
+static int
+rw_lock_get_free_reader_index(rec_rdt_manager *manager){
+    int index;
+
+    if (manager->insert_index < manager->thread_total_no)
+	return manager->insert_index++;
+
+    for (index = 0; index < manager->thread_total_no; index++){
+	if (manager->reader_threads_count_in_CS[index] == 0)
+	    return index;
+    }
+
+    /* There are more concurrent readers than 'thread_total_no' */
+    my_assert(NULL, __FILE__, __LINE__, 0);
+
+    return -1;
+}
+
+/*
+ * Return true if 'owner' holds the read lock registered in 'manager'.
+ */
+static bool
+rw_lock_is_reader(rec_rdt_manager *manager, rw_lock_owner owner){
+    int index;
+
+    return (index = rw_lock_get_reader_index(manager, owner)) != -1 &&
+	manager->reader_threads_count_in_CS[index] > 0;
+}
+
+/*
+ * Size of the arrays of the reader thread manager for 'thread_total_no'.
+ * The arrays are carved from the memory of their owner, i.e. the lock or
+ * the shards, instead of being allocated one by one.
+ */
+static size_t
+rw_lock_manager_size(unsigned int thread_total_no){
+    return (sizeof(rw_lock_owner) + sizeof(int)) * thread_total_no;
+}
+
+/*
+ * Set up the reader thread manager on 'mem' of rw_lock_manager_size() bytes.
+ */
+static void
+rw_lock_manager_init(rec_rdt_manager *manager, unsigned int thread_total_no,
+		     void *mem){
+    int i;
+
+    manager->thread_total_no = thread_total_no;
+    manager->reader_thread_ids = (rw_lock_owner *) mem;
+    manager->reader_threads_count_in_CS =
+	(int *) (manager->reader_thread_ids + thread_total_no);
+
+    manager->insert_index = 0;
+
+    for (i = 0; i < thread_total_no; i++){
+	manager->reader_threads_count_in_CS[i] = 0;
+	manager->reader_thread_ids[i] = 0;
+    }
+}
+
+/*
+ * Size of a lock including its reader thread manager.
+ */
+static size_t
+rw_lock_size(unsigned int thread_total_no){
+    return sizeof(rw_lock) + rw_lock_manager_size(thread_total_no);
+}
+
+/*
+ * Set up a new lock on the memory of rw_lock_size() bytes. 'class_index'
+ * is the class of the lock-order validator resolved from 'attr', or -1.
+ */
+static void
+rw_lock_setup(rw_lock *new_rwl, unsigned int thread_total_no,
+	      const rw_lock_attr *attr, int class_index, rw_lock_pool *pool){
+    if (pthread_mutex_init(&new_rwl->state_mutex, NULL) != 0){
+	perror("pthread_mutex_init");
+	exit(-1);
+    }
+
+    if (pthread_cond_init(&new_rwl->state_cv, NULL) != 0){
+	perror("pthread_cond_init");
+	exit(-1);
+    }
+
+    /* Reader thread manager, placed right after the lock */
+    rw_lock_manager_init(&new_rwl->manager, thread_total_no, new_rwl + 1);
+
+    new_rwl->running_threads_in_CS = 0;
+    new_rwl->waiting_reader_threads = 0;
+    new_rwl->writer_recursive_count = 0;
+    new_rwl->waiting_writer_threads = 0;
+    new_rwl->is_locked_by_reader = false;
+    new_rwl->is_locked_by_writer = false;
+    new_rwl->writer_thread_in_CS = 0;
+    new_rwl->async_waiters_head = NULL;
+    new_rwl->async_waiters_tail = NULL;
+
+    new_rwl->recursive = attr == NULL || attr->recursive;
+    new_rwl->fairness = attr != NULL ? attr->fairness : RW_LOCK_PREFER_READERS;
+    new_rwl->max_readers = attr != NULL ? attr->max_readers : 0;
+    new_rwl->capped_readers_head = NULL;
+    new_rwl->capped_readers_tail = NULL;
+
+    /* The shards rely on the recursion tracking to find the readers */
+    my_assert(NULL, __FILE__, __LINE__,
+	      attr == NULL || !attr->adaptive || new_rwl->recursive);
+    /* The readers in the shards are not counted against the cap */
+    my_assert(NULL, __FILE__, __LINE__,
+	      attr == NULL || !attr->adaptive || attr->max_readers == 0);
+    my_assert(NULL, __FILE__, __LINE__,
+	      attr == NULL || attr->max_readers <= UINT16_MAX);
+
+    /* Start with the compact centralized mode */
+    new_rwl->adaptive = attr != NULL && attr->adaptive;
+    new_rwl->repr = RW_LOCK_CENTRALIZED;
+    new_rwl->fast_readers_allowed = false;
+    new_rwl->writer_draining = false;
+    new_rwl->async_writer_draining = false;
+    new_rwl->shards = NULL;
+    new_rwl->snzi_root = NULL;
+    new_rwl->window_reads = 0;
+    new_rwl->window_shared_reads = 0;
+    new_rwl->window_writes = 0;
+
+    new_rwl->pool = pool;
+
+    new_rwl->class_index = class_index;
+}
+
+void
+rw_lock_attr_init(rw_lock_attr *attr){
+    attr->adaptive = false;
+    attr->recursive = true;
+    attr->fairness = RW_LOCK_PREFER_READERS;
+    attr->lock_class = NULL;
+    attr->max_readers = 0;
+}
+
+rw_lock *
+rw_lock_init_attr(unsigned int thread_total_no, const rw_lock_attr *attr){
+    rw_lock *new_rwl;
+
+    my_assert(NULL, __FILE__, __LINE__, thread_total_no >= 0);
+
+    if ((new_rwl = (rw_lock *) malloc(rw_lock_size(thread_total_no))) == NULL){
+	perror("malloc");
+	exit(-1);
+    }
+
+    rw_lock_setup(new_rwl, thread_total_no, attr,
+		  attr != NULL && attr->lock_class != NULL ?
+		  rw_lock_class_lookup(attr->lock_class) : -1, NULL);
+
+    return new_rwl;
+}
+
+rw_lock *
+rw_lock_init(unsigned int thread_total_no){
+    return rw_lock_init_attr(thread_total_no, NULL);
+}
+
+/*
+ * Slab of a rw_lock_pool. The header occupies the first cache line and
+ * the locks follow it, each aligned to the cache line.
+ */
+typedef struct rw_lock_slab {
+    struct rw_lock_slab *next;
+} rw_lock_slab;
+
+/* Free lock in a rw_lock_pool */
+typedef struct rw_lock_pool_slot {
+    struct rw_lock_pool_slot *next;
+} rw_lock_pool_slot;
+
+struct rw_lock_pool {
+    unsigned int thread_total_no;
+    rw_lock_attr attr;
+    /* Class of the lock-order validator shared by the locks, or -1 */
+    int class_index;
+    /* Size of a lock rounded up to the cache line */
+    size_t slot_size;
+    unsigned int slab_locks_no;
+    rw_lock_slab *slabs;
+    rw_lock_pool_slot *free_slots;
+    unsigned int locks_in_use;
+    pthread_mutex_t pool_mutex;
+};
+
+/*
+ * Create a pool of the locks sharing 'thread_total_no' and 'attr'. The locks
+ * are carved from slabs of 'slab_locks_no' locks, or of the default number
+ * when it is zero.
+ */
+rw_lock_pool *
+rw_lock_pool_create(unsigned int thread_total_no, const rw_lock_attr *attr,
+		    unsigned int slab_locks_no){
+    rw_lock_pool *pool;
+
+    if ((pool = (rw_lock_pool *) malloc(sizeof(rw_lock_pool))) == NULL){
+	perror("malloc");
+	exit(-1);
+    }
+
+    if (pthread_mutex_init(&pool->pool_mutex, NULL) != 0){
+	perror("pthread_mutex_init");
+	exit(-1);
+    }
+
+    pool->thread_total_no = thread_total_no;
+    if (attr != NULL)
+	pool->attr = *attr;
+    else
+	rw_lock_attr_init(&pool->attr);
+
+    /* Resolve the class once. The caller's name may not outlive this call */
+    pool->class_index = pool->attr.lock_class != NULL ?
+	rw_lock_class_lookup(pool->attr.lock_class) : -1;
+    pool->attr.lock_class = NULL;
+    pool->slot_size = (rw_lock_size(thread_total_no) + CACHE_LINE_SIZE - 1) &
+	~((size_t) CACHE_LINE_SIZE - 1);
+    pool->slab_locks_no = slab_locks_no > 0 ? slab_locks_no : RW_LOCK_POOL_SLAB_LOCKS_NO;
+    pool->slabs = NULL;
+    pool->free_slots = NULL;
+    pool->locks_in_use = 0;
+
+    return pool;
+}
+
+/*
+ * Add a new slab to the pool. Called with the pool mutex held.
+ */
+static void
+rw_lock_pool_grow(rw_lock_pool *pool){
+    rw_lock_slab *slab;
+    rw_lock_pool_slot *slot;
+    char *locks;
+    int i;
+
+    if (posix_memalign((void **) &slab, CACHE_LINE_SIZE,
+		       CACHE_LINE_SIZE + pool->slot_size * pool->slab_locks_no) != 0){
+	perror("posix_memalign");
+	exit(-1);
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    /* Link the slots in the reverse order to hand them out in the address order */
+    locks = (char *) slab + CACHE_LINE_SIZE;
+    for (i = pool->slab_locks_no - 1; i >= 0; i--){
+	slot = (rw_lock_pool_slot *) (locks + pool->slot_size * i);
+	slot->next = pool->free_slots;
+	pool->free_slots = slot;
+    }
+}
+
+/*
+ * Take a lock from the pool. Called with the pool mutex held.
+ */
+static rw_lock *
+rw_lock_pool_get(rw_lock_pool *pool){
+    rw_lock_pool_slot *slot;
+    rw_lock *new_rwl;
+
+    if (pool->free_slots == NULL)
+	rw_lock_pool_grow(pool);
+
+    slot = pool->free_slots;
+    pool->free_slots = slot->next;
+    pool->locks_in_use++;
+
+    new_rwl = (rw_lock *) slot;
+    rw_lock_setup(new_rwl, pool->thread_total_no, &pool->attr,
+		  pool->class_index, pool);
+
+    return new_rwl;
+}
+
+/*
+ * Return a torn down lock to its pool. Called with the pool mutex held.
+ */
+static void
+rw_lock_pool_put(rw_lock_pool *pool, rw_lock *rwl){
+    rw_lock_pool_slot *slot = (rw_lock_pool_slot *) rwl;
+
+    my_assert(NULL, __FILE__, __LINE__, pool->locks_in_use > 0);
+
+    slot->next = pool->free_slots;
+    pool->free_slots = slot;
+    pool->locks_in_use--;
+}
+
+/*
+ * Initialize a lock carved from the pool. Release it by rw_lock_destroy(),
+ * which recycles it for the subsequent initializations.
+ */
+rw_lock *
+rw_lock_pool_init_lock(rw_lock_pool *pool){
+    rw_lock *new_rwl;
+
+    pthread_mutex_lock(&pool->pool_mutex);
+    new_rwl = rw_lock_pool_get(pool);
+    pthread_mutex_unlock(&pool->pool_mutex);
+
+    return new_rwl;
+}
+
+/*
+ * Initialize 'locks_no' locks carved from the pool into 'locks'.
+ */
+void
+rw_lock_pool_init_locks(rw_lock_pool *pool, rw_lock **locks,
+			unsigned int locks_no){
+    int i;
+
+    pthread_mutex_lock(&pool->pool_mutex);
+    for (i = 0; i < locks_no; i++)
+	locks[i] = rw_lock_pool_get(pool);
+    pthread_mutex_unlock(&pool->pool_mutex);
+}
+
+/*
+ * Free all the slabs of the pool. All the locks carved from the pool must
+ * have been destroyed.
+ */
+void
+rw_lock_pool_destroy(rw_lock_pool *pool){
+    rw_lock_slab *slab, *next;
+
+    my_assert(NULL, __FILE__, __LINE__, pool->locks_in_use == 0);
+
+    for (slab = pool->slabs; slab != NULL; slab = next){
+	next = slab->next;
+	free(slab);
+    }
+
+    pthread_mutex_destroy(&pool->pool_mutex);
+    free(pool);
+}
+
+static rw_lock_reader_shard *
+rw_lock_get_shard(rw_lock *rwl, rw_lock_owner owner){
+    /* Fibonacci hashing spreads the aligned thread and task addresses */
+    uint64_t hash = (uint64_t) owner * 0x9E3779B97F4A7C15ULL;
+
+    return &rwl->shards[(hash >> 32) % RW_LOCK_SHARDS_NO];
+}
+
+static bool rw_lock_snzi_depart(rw_lock_snzi_node *node);
+
+/*
+ * Announce a non-zero child of 'node'. Called with the lock of the shard
+ * below held, only when the shard becomes non-zero.
+ *
+ * The first arrival at a zero node marks it half, arrives at the parent and
+ * then completes the node to one. The arrivals seeing the half node help
+ * the parent arrival, so that none of them returns before the parent is
+ * non-zero. The extra parent arrivals of the helpers are undone at the end.
+ */
+static void
+rw_lock_snzi_arrive(rw_lock_snzi_node *node){
+    uint64_t state;
+    uint32_t surplus, version;
+    bool arrived = false;
+    int undo = 0;
+
+    if (node->parent == NULL){
+	__atomic_add_fetch(&node->state, 1, __ATOMIC_SEQ_CST);
+	return;
+    }
+
+    while(!arrived){
+	state = __atomic_load_n(&node->state, __ATOMIC_SEQ_CST);
+	surplus = RW_LOCK_SNZI_SURPLUS(state);
+	version = RW_LOCK_SNZI_VERSION(state);
+
+	if (surplus >= RW_LOCK_SNZI_ONE){
+	    arrived = __atomic_compare_exchange_n(&node->state, &state,
+						  state + RW_LOCK_SNZI_ONE, false,
+						  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	    continue;
+	}
+
+	if (surplus == 0){
+	    if (!__atomic_compare_exchange_n(&node->state, &state,
+					     RW_LOCK_SNZI_STATE(RW_LOCK_SNZI_HALF, version + 1),
+					     false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		continue;
+	    arrived = true;
+	    state = RW_LOCK_SNZI_STATE(RW_LOCK_SNZI_HALF, ++version);
+	}
+
+	/* The node is half. Make the parent non-zero, then complete the node */
+	rw_lock_snzi_arrive(node->parent);
+	if (!__atomic_compare_exchange_n(&node->state, &state,
+					 RW_LOCK_SNZI_STATE(RW_LOCK_SNZI_ONE, version),
+					 false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	    undo++;
+    }
+
+    while(undo-- > 0)
+	rw_lock_snzi_depart(node->parent);
+}
+
+/*
+ * Withdraw a child of 'node' which has become zero. Called with the lock of
+ * the shard below held.
+ *
+ * Return true if the root has become zero, i.e. the last reader has left.
+ */
+static bool
+rw_lock_snzi_depart(rw_lock_snzi_node *node){
+    uint64_t state;
+
+    if (node->parent == NULL)
+	return __atomic_sub_fetch(&node->state, 1, __ATOMIC_SEQ_CST) == 0;
+
+    state = __atomic_load_n(&node->state, __ATOMIC_SEQ_CST);
+    while(!__atomic_compare_exchange_n(&node->state, &state,
+				       state - RW_LOCK_SNZI_ONE, false,
+				       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	;
+
+    if (RW_LOCK_SNZI_SURPLUS(state) == RW_LOCK_SNZI_ONE)
+	return rw_lock_snzi_depart(node->parent);
+
+    return false;
+}
+
+/*
+ * Return true if any reader holds the lock via the shards. The writer closes
+ * the gate of the fast path before this, so that either the writer sees a
+ * new reader here or the reader sees the closed gate.
+ */
+static bool
+rw_lock_shard_readers_present(rw_lock *rwl){
+    return __atomic_load_n(&rwl->snzi_root->state, __ATOMIC_SEQ_CST) != 0;
+}
+
+static bool
+rw_lock_fast_readers_allowed(rw_lock *rwl){
+    return __atomic_load_n(&rwl->fast_readers_allowed, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Open or close the gate of the fast path. Called with the state mutex held.
+ */
+static void
+rw_lock_set_fast_readers_allowed(rw_lock *rwl, bool allowed){
+    __atomic_store_n(&rwl->fast_readers_allowed, allowed, __ATOMIC_SEQ_CST);
+}
+
+static rw_lock_repr
+rw_lock_get_repr(rw_lock *rwl){
+    return __atomic_load_n(&rwl->repr, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Open the gate if nothing prevents the readers in the distributed mode.
+ */
+static void
+rw_lock_reopen_fast_path(rw_lock *rwl){
+    if (rwl->repr == RW_LOCK_DISTRIBUTED && !rwl->is_locked_by_writer &&
+	!rwl->writer_draining && !rwl->async_writer_draining)
+	rw_lock_set_fast_readers_allowed(rwl, true);
+}
+
+/*
+ * Allocate the shards, the SNZI tree and the reader thread managers of the
+ * shards in one block, which is released by rw_lock_free_shards().
+ */
+static void
+rw_lock_alloc_shards(rw_lock *rwl){
+    unsigned int thread_total_no = rwl->manager.thread_total_no;
+    size_t manager_size = rw_lock_manager_size(thread_total_no);
+    rw_lock_reader_shard *shards;
+    rw_lock_snzi_node *nodes;
+    char *managers;
+    int i;
+
+    if (posix_memalign((void **) &shards, CACHE_LINE_SIZE,
+		       sizeof(rw_lock_reader_shard) * RW_LOCK_SHARDS_NO +
+		       sizeof(rw_lock_snzi_node) * (1 + RW_LOCK_SNZI_INNER_NO) +
+		       manager_size * RW_LOCK_SHARDS_NO) != 0){
+	perror("posix_memalign");
+	exit(-1);
+    }
+
+    /* The root comes first, followed by the inner nodes */
+    nodes = (rw_lock_snzi_node *) (shards + RW_LOCK_SHARDS_NO);
+    managers = (char *) (nodes + 1 + RW_LOCK_SNZI_INNER_NO);
+
+    nodes[0].state = 0;
+    nodes[0].parent = NULL;
+    for (i = 1; i <= RW_LOCK_SNZI_INNER_NO; i++){
+	nodes[i].state = 0;
+	nodes[i].parent = &nodes[0];
+    }
+
+    for (i = 0; i < RW_LOCK_SHARDS_NO; i++){
+	if (pthread_spin_init(&shards[i].lock, PTHREAD_PROCESS_PRIVATE) != 0){
+	    perror("pthread_spin_init");
+	    exit(-1);
+	}
+	shards[i].readers = 0;
+	shards[i].node = &nodes[1 + i / RW_LOCK_SNZI_FANOUT];
+	shards[i].reads = 0;
+	rw_lock_manager_init(&shards[i].manager, thread_total_no,
+			     managers + manager_size * i);
+    }
+
+    rwl->shards = shards;
+    rwl->snzi_root = &nodes[0];
+}
+
+static void
+rw_lock_free_shards(rw_lock *rwl){
+    int i;
+
+    if (rwl->shards == NULL)
+	return;
+
+    for (i = 0; i < RW_LOCK_SHARDS_NO; i++)
+	pthread_spin_destroy(&rwl->shards[i].lock);
+    free(rwl->shards);
+
+    rwl->shards = NULL;
+    rwl->snzi_root = NULL;
+}
+
+static void
+rw_lock_reset_window(rw_lock *rwl){
+    int i;
+
+    rwl->window_reads = 0;
+    rwl->window_shared_reads = 0;
+    rwl->window_writes = 0;
+    if (rwl->shards != NULL){
+	for (i = 0; i < RW_LOCK_SHARDS_NO; i++)
+	    __atomic_store_n(&rwl->shards[i].reads, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Switch to the distributed mode when the reads dominate and the readers
+ * share the lock. Called with the state mutex held whenever a lock is
+ * released in the centralized mode.
+ *
+ * The readers in the centralized C.S. may keep running. They release their
+ * locks via the centralized tracking, and writers wait for both kinds of
+ * readers.
+ */
+static void
+rw_lock_adapt_to_reads(rw_lock *rwl){
+    uint32_t total = rwl->window_reads + rwl->window_writes;
+
+    if (!rwl->adaptive || rwl->repr != RW_LOCK_CENTRALIZED ||
+	total < RW_LOCK_ADAPT_WINDOW)
+	return;
+
+    if (rwl->window_reads * 100 >= total * RW_LOCK_ADAPT_DISTRIBUTED_READ_PCT &&
+	rwl->window_shared_reads * 4 >= rwl->window_reads){
+	if (rwl->shards == NULL)
+	    rw_lock_alloc_shards(rwl);
+	__atomic_store_n(&rwl->repr, RW_LOCK_DISTRIBUTED, __ATOMIC_RELEASE);
+	rw_lock_reopen_fast_path(rwl);
+    }
+
+    rw_lock_reset_window(rwl);
+}
+
+/*
+ * Switch back to the centralized mode when the writes increase. Called with
+ * the state mutex held by the writer that has just drained all the readers,
+ * so no reader is in the shards. The gate is closed by the writer already.
+ */
+static void
+rw_lock_adapt_to_writes(rw_lock *rwl){
+    uint32_t reads = 0, total;
+    int i;
+
+    if (rwl->repr != RW_LOCK_DISTRIBUTED)
+	return;
+
+    for (i = 0; i < RW_LOCK_SHARDS_NO; i++)
+	reads += __atomic_load_n(&rwl->shards[i].reads, __ATOMIC_RELAXED);
+    total = reads + rwl->window_writes;
+
+    if (total < RW_LOCK_ADAPT_WINDOW)
+	return;
+
+    if (reads * 100 < total * RW_LOCK_ADAPT_CENTRALIZED_READ_PCT)
+	__atomic_store_n(&rwl->repr, RW_LOCK_CENTRALIZED, __ATOMIC_RELEASE);
+
+    rw_lock_reset_window(rwl);
+}
+
+/*
+ * For any read operation, wait only if the lock is taken
+ * by a write thread.
+ *
+ * There is no need to check the reader related conditions
+ * in the below predicate, because even if other reader
+ * thread took a lock, it is harmless to set the flag of
+ * reader's lock true again (and also, to increment the
+ * number of reader threads).
+ *
+ * In the distributed mode, wait also while a writer is draining the
+ * readers from the shards. When the writers are preferred, wait also while
+ * any writer is waiting. When the readers are capped, wait also while all
+ * the slots are taken.
+ */
+static bool
+rw_lock_rd_lock_acquirable(rw_lock *rwl){
+    return !(rwl->writer_thread_in_CS && rwl->is_locked_by_writer) &&
+	!rwl->writer_draining && !rwl->async_writer_draining &&
+	!(rwl->fairness == RW_LOCK_PREFER_WRITERS && rwl->waiting_writer_threads > 0) &&
+	!(rwl->max_readers > 0 && rwl->running_threads_in_CS >= rwl->max_readers);
+}
+
+/*
+ * For any new write operation, wait if the lock is
+ * taken by any other writer thread or if any reader thread
+ * is taking the lock.
+ *
+ * The readers in the shards are drained after this is satisfied.
+ */
+static bool
+rw_lock_wr_lock_acquirable(rw_lock *rwl){
+    return !((rwl->writer_thread_in_CS && rwl->is_locked_by_writer) ||
+	     (rwl->is_locked_by_reader && rwl->running_threads_in_CS > 0)) &&
+	!rwl->writer_draining && !rwl->async_writer_draining;
+}
+
+/*
+ * Let 'owner' enter the C.S. as a reader in the centralized tracking.
+ */
+static void
+rw_lock_rd_lock_enter_centralized(rw_lock *rwl, rw_lock_owner owner){
+    rec_rdt_manager *manager;
+    int index;
+
+    if (!rwl->recursive){
+	rwl->running_threads_in_CS++;
+	rwl->is_locked_by_reader = true;
+	RW_LOCK_PROBE6(acquire_granted, rwl, RW_LOCK_READ, owner, 1,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	return;
+    }
+
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->writer_thread_in_CS == 0);
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->is_locked_by_writer == false);
+
+    /*
+     * Manage reader thread's count of the lock, including recursive ones
+     */
+    manager = &rwl->manager;
+    if ((index = rw_lock_get_reader_index(manager, owner)) == -1 ||
+	manager->reader_threads_count_in_CS[index] == 0){
+	if (index == -1)
+	    index = rw_lock_get_free_reader_index(manager);
+
+	/* Ensure this lock is a completely new lock */
+	my_assert(NULL, __FILE__, __LINE__,
+		  manager->reader_threads_count_in_CS[index] == 0);
+
+	if (rwl->running_threads_in_CS > 0)
+	    rwl->window_shared_reads++;
+	rwl->window_reads++;
+
+	rwl->running_threads_in_CS++;
+	rwl->is_locked_by_reader = true;
+	manager->reader_threads_count_in_CS[index] = 1;
+	manager->reader_thread_ids[index] = owner;
+
+    }else{
+	/*
+	 * If this is a recursive lock, then increment the count
+	 */
+	my_assert(NULL, __FILE__, __LINE__,
+		  rwl->is_locked_by_reader);
+
+	manager->reader_threads_count_in_CS[index]++;
+    }
+
+    RW_LOCK_PROBE6(acquire_granted, rwl, RW_LOCK_READ, owner,
+		   manager->reader_threads_count_in_CS[index],
+		   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+}
+
+/*
+ * Let 'owner' take the read lock via its shard in the distributed mode.
+ *
+ * The recursive lock always succeeds. For a new lock, the caller without the
+ * state mutex sets 'check_gate' to back off when a writer closes the gate
+ * concurrently, and gets false in that case. Under the state mutex, the gate
+ * can't be closed and 'check_gate' is false.
+ */
+static bool
+rw_lock_rd_lock_enter_shard(rw_lock *rwl, rw_lock_owner owner, bool check_gate){
+    rw_lock_reader_shard *shard = rw_lock_get_shard(rwl, owner);
+    bool drained;
+    int index;
+
+    pthread_spin_lock(&shard->lock);
+
+    if ((index = rw_lock_get_reader_index(&shard->manager, owner)) != -1 &&
+	shard->manager.reader_threads_count_in_CS[index] > 0){
+	shard->manager.reader_threads_count_in_CS[index]++;
+	RW_LOCK_SHARD_PROBE(acquire_granted, rwl, owner,
+			    shard->manager.reader_threads_count_in_CS[index]);
+	pthread_spin_unlock(&shard->lock);
+	return true;
+    }
+
+    if (check_gate && !rw_lock_fast_readers_allowed(rwl)){
+	pthread_spin_unlock(&shard->lock);
+	return false;
+    }
+
+    /*
+     * Announce this reader first, then confirm that no writer has closed
+     * the gate. Pairs with rw_lock_shard_readers_present().
+     */
+    if (shard->readers++ == 0)
+	rw_lock_snzi_arrive(shard->node);
+    if (check_gate && !rw_lock_fast_readers_allowed(rwl)){
+	drained = --shard->readers == 0 && rw_lock_snzi_depart(shard->node);
+	pthread_spin_unlock(&shard->lock);
+	if (drained)
+	    rw_lock_notify_drained(rwl);
+	return false;
+    }
+
+    if (index == -1)
+	index = rw_lock_get_free_reader_index(&shard->manager);
+    shard->manager.reader_threads_count_in_CS[index] = 1;
+    shard->manager.reader_thread_ids[index] = owner;
+    __atomic_add_fetch(&shard->reads, 1, __ATOMIC_RELAXED);
+    RW_LOCK_SHARD_PROBE(acquire_granted, rwl, owner, 1);
+
+    pthread_spin_unlock(&shard->lock);
+
+    return true;
+}
+
+/*
+ * Release the read lock 'owner' took via its shard.
+ *
+ * Return false if 'owner' doesn't hold the read lock in the shards.
+ */
+static bool
+rw_lock_rd_unlock_shard(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_reader_shard *shard = rw_lock_get_shard(rwl, owner);
+    bool drained;
+    int index;
+
+    pthread_spin_lock(&shard->lock);
+
+    if ((index = rw_lock_get_reader_index(&shard->manager, owner)) == -1 ||
+	shard->manager.reader_threads_count_in_CS[index] == 0){
+	pthread_spin_unlock(&shard->lock);
+	return false;
+    }
+
+    RW_LOCK_SHARD_PROBE(release, rwl, owner,
+			shard->manager.reader_threads_count_in_CS[index] - 1);
+    if (--shard->manager.reader_threads_count_in_CS[index] > 0){
+	pthread_spin_unlock(&shard->lock);
+	return true;
+    }
+
+    drained = --shard->readers == 0 && rw_lock_snzi_depart(shard->node);
+    pthread_spin_unlock(&shard->lock);
+
+    /*
+     * A closed gate means that a writer may be waiting for the last reader
+     * to leave the shards
+     */
+    if (drained && !rw_lock_fast_readers_allowed(rwl))
+	rw_lock_notify_drained(rwl);
+
+    return true;
+}
+
+/*
+ * Let 'owner' enter the C.S. as a reader. The caller holds the state mutex
+ * and has confirmed rw_lock_rd_lock_acquirable(), unless this is a
+ * recursive lock.
+ */
+static void
+rw_lock_rd_lock_enter(rw_lock *rwl, rw_lock_owner owner){
+    if (rwl->repr == RW_LOCK_DISTRIBUTED && !rw_lock_is_reader(&rwl->manager, owner))
+	rw_lock_rd_lock_enter_shard(rwl, owner, false);
+    else
+	rw_lock_rd_lock_enter_centralized(rwl, owner);
+}
+
+/*
+ * Return true if 'owner' holds the read lock. Called with the state mutex held.
+ */
+static bool
+rw_lock_rd_lock_held(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_reader_shard *shard;
+    bool held;
+
+    if (rw_lock_is_reader(&rwl->manager, owner))
+	return true;
+
+    if (rwl->repr != RW_LOCK_DISTRIBUTED)
+	return false;
+
+    shard = rw_lock_get_shard(rwl, owner);
+    pthread_spin_lock(&shard->lock);
+    held = rw_lock_is_reader(&shard->manager, owner);
+    pthread_spin_unlock(&shard->lock);
+
+    return held;
+}
+
+/*
+ * Support the recursive locking. Return true if 'owner' is the writer in
+ * the C.S. already and got the lock again.
+ */
+static bool
+rw_lock_wr_lock_reenter(rw_lock *rwl, rw_lock_owner owner){
+    if (rwl->recursive && rwl->is_locked_by_writer &&
+	rwl->writer_thread_in_CS == owner){
+	my_assert(NULL, __FILE__, __LINE__,
+		  rwl->running_threads_in_CS == 1);
+	my_assert(NULL, __FILE__, __LINE__,
+		  rwl->is_locked_by_reader == false);
+
+	rwl->writer_recursive_count++;
+	RW_LOCK_PROBE6(acquire_granted, rwl, RW_LOCK_WRITE, owner,
+		       rwl->writer_recursive_count,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	return true;
+    }
+
+    return false;
+}
+
+/*
+ * Let 'owner' enter the C.S. as a writer. The caller holds the state mutex
+ * and has confirmed rw_lock_wr_lock_acquirable() and the drain of the shards.
+ */
+static void
+rw_lock_wr_lock_enter(rw_lock *rwl, rw_lock_owner owner){
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->writer_thread_in_CS == 0);
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->is_locked_by_reader == false);
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->is_locked_by_writer == false);
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->running_threads_in_CS == 0);
+    my_assert(NULL, __FILE__, __LINE__,
+	      rwl->writer_recursive_count == 0);
+
+    rwl->writer_recursive_count = 1;
+    rwl->running_threads_in_CS = 1;
+    rwl->is_locked_by_writer = true;
+    rwl->writer_thread_in_CS = owner;
+    RW_LOCK_PROBE6(acquire_granted, rwl, RW_LOCK_WRITE, owner, 1,
+		   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+
+    rwl->window_writes++;
+    rw_lock_adapt_to_writes(rwl);
+}
+
+/*
+ * The owner of the locks taken by the calling thread. Zero means that the
+ * thread itself is the owner, which is the default.
+ */
+static __thread rw_lock_owner current_owner = 0;
+
+/*
+ * Make the calling thread act on behalf of 'owner' for the subsequent calls
+ * of rw_lock_rd_lock(), rw_lock_wr_lock() and rw_lock_unlock().
+ *
+ * A scheduler migrating tasks between threads sets the task's owner handle
+ * whenever it resumes the task, so the locks follow the task rather than
+ * the thread. Pass zero to restore the pthread_self() based ownership.
+ */
+void
+rw_lock_set_owner(rw_lock_owner owner){
+    current_owner = owner;
+}
+
+/*
+ * Return the owner handle that the calling thread currently acts for.
+ */
+rw_lock_owner
+rw_lock_get_owner(void){
+    if (current_owner != 0)
+	return current_owner;
+
+    return (rw_lock_owner) pthread_self();
+}
+
+/*
+ * Lock-order validator. Opted in per lock by rw_lock_attr.lock_class.
+ *
+ * Every owner keeps the stack of the validated locks it holds. When an
+ * owner waits for a lock while holding others, the order "held class ->
+ * new class" is recorded in the global graph of the lock classes. The
+ * first time an order is recorded, the graph is searched for the reverse
+ * path, which means that another code path takes the same classes in the
+ * opposite order and the two may deadlock. Such a cycle and a read lock
+ * upgraded to the write lock, which waits for the caller itself, are
+ * reported by my_assert() without waiting for the actual deadlock.
+ *
+ * The graph is a bit matrix updated by atomic OR, and every thread caches
+ * the orders it has already seen, so the known orders cost neither a lock
+ * nor a shared write.
+ *
+ * The stacks live in a global table keyed on the owner while it holds any
+ * lock, so that a lock released by another thread for the owner leaves its
+ * stack, whether the owner is a thread or an explicit handle.
+ *
+ * The trylocks are recorded as held, but never add an order since they
+ * don't wait. The asynchronous requests are not validated.
+ */
+#define RW_LOCK_CLASSES_NO 256
+#define RW_LOCK_HELD_LOCKS_NO 32
+#define RW_LOCK_HELD_STACKS_NO 256
+#define RW_LOCK_ORDER_CACHE_NO 64
+#define RW_LOCK_REPORT_LEN 256
+
+typedef struct rw_lock_class {
+    const char *name;
+    bool upgrade_reported;
+} rw_lock_class;
+
+static rw_lock_class lock_classes[RW_LOCK_CLASSES_NO];
+
+/* The bit 'j' of lock_order[i] is set once the class j was waited for holding i */
+static uint64_t lock_order[RW_LOCK_CLASSES_NO][RW_LOCK_CLASSES_NO / 64];
+
+typedef struct rw_lock_held {
+    rw_lock *rwl;
+    rw_lock_mode mode;
+    int depth;
+} rw_lock_held;
+
+typedef struct rw_lock_held_stack {
+    /* The owner of the stack, or zero if it's free */
+    rw_lock_owner owner;
+    /* Locked by the thread reading or updating the stack */
+    bool busy;
+    int held_locks_no;
+    rw_lock_held held_locks[RW_LOCK_HELD_LOCKS_NO];
+} __attribute__((aligned(CACHE_LINE_SIZE))) rw_lock_held_stack;
+
+static rw_lock_held_stack held_stacks[RW_LOCK_HELD_STACKS_NO];
+static __thread rw_lock_held_stack *cached_held_stack;
+static __thread uint32_t lock_order_cache[RW_LOCK_ORDER_CACHE_NO];
+static __thread char lock_order_report[RW_LOCK_REPORT_LEN];
+
+/*
+ * Return the index of the class 'name', registering it if it's new. The
+ * classes are identified by the contents of the names, and the table keeps
+ * its own copies of them.
+ */
+static int
+rw_lock_class_lookup(const char *name){
+    const char *expected;
+    char *copy = NULL;
+    uint32_t hash = 2166136261u;
+    const char *p;
+    int i, index;
+
+    /* FNV-1a */
+    for (p = name; *p != '\0'; p++)
+	hash = (hash ^ (unsigned char) *p) * 16777619u;
+
+    index = hash % RW_LOCK_CLASSES_NO;
+    for (i = 0; i < RW_LOCK_CLASSES_NO; i++, index = (index + 1) % RW_LOCK_CLASSES_NO){
+	/* Copy the name only to register a new class */
+	if ((expected = __atomic_load_n(&lock_classes[index].name,
+					__ATOMIC_ACQUIRE)) == NULL){
+	    if (copy == NULL && (copy = strdup(name)) == NULL){
+		perror("strdup");
+		exit(-1);
+	    }
+	    if (__atomic_compare_exchange_n(&lock_classes[index].name, &expected, copy,
+					    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return index;
+	}
+	if (strcmp(expected, name) == 0){
+	    free(copy);
+	    return index;
+	}
+    }
+
+    free(copy);
+    my_assert("Too many lock classes to validate", __FILE__, __LINE__, 0);
+
+    return -1;
+}
+
+static bool
+rw_lock_order_recorded(int from, int to){
+    return (__atomic_load_n(&lock_order[from][to / 64], __ATOMIC_SEQ_CST) >>
+	    (to % 64)) & 1;
+}
+
+/*
+ * Search the recorded orders for a path from the class 'from' to 'to'.
+ * On success, fill 'path' with the classes on the path from 'from' and
+ * return its length. Otherwise, return 0.
+ */
+static int
+rw_lock_order_search(int from, int to, int *path){
+    int parent[RW_LOCK_CLASSES_NO], queue[RW_LOCK_CLASSES_NO];
+    int head = 0, tail = 0, len, i, next;
+
+    for (i = 0; i < RW_LOCK_CLASSES_NO; i++)
+	parent[i] = -1;
+
+    parent[from] = from;
+    queue[tail++] = from;
+    while(head < tail){
+	i = queue[head++];
+	if (i == to)
+	    break;
+	for (next = 0; next < RW_LOCK_CLASSES_NO; next++){
+	    if (parent[next] == -1 && rw_lock_order_recorded(i, next)){
+		parent[next] = i;
+		queue[tail++] = next;
+	    }
+	}
+    }
+
+    if (parent[to] == -1)
+	return 0;
+
+    /* Count the path length, then fill it from the end */
+    for (len = 1, i = to; i != from; i = parent[i])
+	len++;
+    for (i = to, next = len - 1; next >= 0; i = parent[i], next--)
+	path[next] = i;
+
+    return len;
+}
+
+/*
+ * Record that the class 'to' has been waited for holding 'from', and
+ * report the cycle closed by this order when it's new.
+ */
+static void
+rw_lock_order_add(int from, int to){
+    uint32_t key = ((uint32_t) from << 16) | (uint32_t) to | 0x80000000;
+    uint32_t *cached = &lock_order_cache[(from * 31 + to) % RW_LOCK_ORDER_CACHE_NO];
+    uint64_t bit = (uint64_t) 1 << (to % 64);
+    int path[RW_LOCK_CLASSES_NO];
+    int len, i, off;
+
+    if (*cached == key)
+	return;
+    *cached = key;
+
+    if (rw_lock_order_recorded(from, to) ||
+	(__atomic_fetch_or(&lock_order[from][to / 64], bit, __ATOMIC_SEQ_CST) & bit))
+	return;
+
+    /* The first observation of this order. Does 'to' lead back to 'from' ? */
+    if ((len = rw_lock_order_search(to, from, path)) == 0)
+	return;
+
+    off = snprintf(lock_order_report, RW_LOCK_REPORT_LEN,
+		   "Lock order cycle: %s", lock_classes[from].name);
+    for (i = 0; i < len && off < RW_LOCK_REPORT_LEN; i++)
+	off += snprintf(lock_order_report + off, RW_LOCK_REPORT_LEN - off,
+			" -> %s", lock_classes[path[i]].name);
+
+    my_assert(lock_order_report, __FILE__, __LINE__, 0);
+}
+
+/*
+ * Return the stack of the locks held by 'owner', locked, or NULL if it has
+ * none and 'create' is false. The stack of a new owner is claimed from the
+ * global table if 'create' is true.
+ *
+ * The stack is keyed on the owner alone, whichever thread calls, since any
+ * thread may release a lock for an owner by rw_lock_unlock_owner(). The
+ * lock of the stack is uncontended except for such a release, and the
+ * stack last used by the thread is cached, so the lookup is usually a load
+ * of its owner.
+ */
+static rw_lock_held_stack *
+rw_lock_lock_held_stack(rw_lock_owner owner, bool create){
+    rw_lock_held_stack *stack;
+    rw_lock_owner expected;
+    int i;
+
+    for (;;){
+	stack = cached_held_stack;
+	if (stack == NULL ||
+	    __atomic_load_n(&stack->owner, __ATOMIC_ACQUIRE) != owner){
+	    stack = NULL;
+	    for (i = 0; i < RW_LOCK_HELD_STACKS_NO; i++){
+		if (__atomic_load_n(&held_stacks[i].owner, __ATOMIC_ACQUIRE) == owner){
+		    stack = &held_stacks[i];
+		    break;
+		}
+	    }
+	}
+
+	if (stack == NULL){
+	    if (!create)
+		return NULL;
+
+	    for (i = 0; i < RW_LOCK_HELD_STACKS_NO; i++){
+		expected = 0;
+		if (__atomic_compare_exchange_n(&held_stacks[i].owner, &expected, owner,
+						false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+		    stack = &held_stacks[i];
+		    break;
+		}
+	    }
+
+	    if (stack == NULL){
+		my_assert("Too many owners holding validated locks",
+			  __FILE__, __LINE__, 0);
+		return NULL;
+	    }
+	}
+
+	while(__atomic_test_and_set(&stack->busy, __ATOMIC_ACQUIRE))
+	    sched_yield();
+
+	/* The stack may have been freed and claimed by another owner meanwhile */
+	if (stack->owner == owner){
+	    cached_held_stack = stack;
+	    return stack;
+	}
+
+	__atomic_clear(&stack->busy, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Unlock 'stack', and let another owner take it if it holds no lock.
+ */
+static void
+rw_lock_unlock_held_stack(rw_lock_held_stack *stack){
+    if (stack->held_locks_no == 0)
+	__atomic_store_n(&stack->owner, 0, __ATOMIC_RELEASE);
+
+    __atomic_clear(&stack->busy, __ATOMIC_RELEASE);
+}
+
+static rw_lock_held *
+rw_lock_find_held(rw_lock_held_stack *stack, rw_lock *rwl){
+    int i;
+
+    if (stack == NULL)
+	return NULL;
+
+    for (i = stack->held_locks_no - 1; i >= 0; i--){
+	if (stack->held_locks[i].rwl == rwl)
+	    return &stack->held_locks[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Validate the acquisition of 'rwl' in 'mode' by 'owner' before it may wait
+ * for the lock. The stack is unlocked before reporting, since my_assert()
+ * may not return.
+ */
+static void
+rw_lock_validate_acquire(rw_lock *rwl, rw_lock_owner owner,
+			 rw_lock_mode mode, bool trylock){
+    rw_lock_held_stack *stack;
+    rw_lock_held *held;
+    int held_classes[RW_LOCK_HELD_LOCKS_NO];
+    int held_classes_no = 0;
+    bool upgrade = false;
+    int i;
+
+    if (trylock || (stack = rw_lock_lock_held_stack(owner, false)) == NULL)
+	return;
+
+    if ((held = rw_lock_find_held(stack, rwl)) != NULL){
+	/* Upgrading the read lock waits for the caller itself to leave */
+	upgrade = held->mode == RW_LOCK_READ && mode == RW_LOCK_WRITE;
+    }else{
+	for (i = 0; i < stack->held_locks_no; i++){
+	    if (stack->held_locks[i].rwl->class_index != rwl->class_index)
+		held_classes[held_classes_no++] = stack->held_locks[i].rwl->class_index;
+	}
+    }
+
+    rw_lock_unlock_held_stack(stack);
+
+    if (upgrade &&
+	!__atomic_exchange_n(&lock_classes[rwl->class_index].upgrade_reported,
+			     true, __ATOMIC_RELAXED)){
+	snprintf(lock_order_report, RW_LOCK_REPORT_LEN,
+		 "Read lock upgraded to the write lock: %s",
+		 lock_classes[rwl->class_index].name);
+	my_assert(lock_order_report, __FILE__, __LINE__, 0);
+    }
+
+    for (i = 0; i < held_classes_no; i++)
+	rw_lock_order_add(held_classes[i], rwl->class_index);
+}
+
+/*
+ * Push 'rwl' to the stack of the locks held by 'owner' after the acquisition.
+ */
+static void
+rw_lock_validate_acquired(rw_lock *rwl, rw_lock_owner owner, rw_lock_mode mode){
+    rw_lock_held_stack *stack;
+    rw_lock_held *held;
+
+    if ((stack = rw_lock_lock_held_stack(owner, true)) == NULL)
+	return;
+
+    if ((held = rw_lock_find_held(stack, rwl)) != NULL){
+	held->depth++;
+    }else if (stack->held_locks_no == RW_LOCK_HELD_LOCKS_NO){
+	rw_lock_unlock_held_stack(stack);
+	my_assert("Too many validated locks held by an owner",
+		  __FILE__, __LINE__, 0);
+	return;
+    }else{
+	stack->held_locks[stack->held_locks_no].rwl = rwl;
+	stack->held_locks[stack->held_locks_no].mode = mode;
+	stack->held_locks[stack->held_locks_no].depth = 1;
+	stack->held_locks_no++;
+    }
+
+    rw_lock_unlock_held_stack(stack);
+}
+
+/*
+ * Pop 'rwl' from the stack of the locks held by 'owner'. Ignore the lock
+ * which wasn't validated on the acquisition, e.g. an asynchronous request.
+ */
+static void
+rw_lock_validate_release(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_held_stack *stack;
+    rw_lock_held *held;
+
+    if ((stack = rw_lock_lock_held_stack(owner, false)) == NULL)
+	return;
+
+    if ((held = rw_lock_find_held(stack, rwl)) != NULL && --held->depth == 0){
+	memmove(held, held + 1,
+		(&stack->held_locks[stack->held_locks_no] - (held + 1)) * sizeof(*held));
+	stack->held_locks_no--;
+    }
+
+    rw_lock_unlock_held_stack(stack);
+}
+
+/*
+ * Wake up the head of the FIFO of the capped readers, if any, to check if
+ * it can take the lock. Called with the state mutex held.
+ */
+static void
+rw_lock_signal_capped_reader(rw_lock *rwl){
+    if (rwl->capped_readers_head != NULL)
+	pthread_cond_signal(&rwl->capped_readers_head->cv);
+}
+
+/*
+ * Same as rw_lock_rd_lock_wait(), but for the lock with 'max_readers'.
+ *
+ * A reader which can't take the lock at once joins the FIFO of the capped
+ * readers, and takes the lock only at the head of the FIFO, so that a slot
+ * freed by a reader goes to the longest waiting reader. A new reader, even
+ * a trylock, doesn't overtake the queued ones.
+ *
+ * The releases wake up the head only, and the head leaving the FIFO passes
+ * the wakeup to the next reader only while a slot is free.
+ */
+static bool
+rw_lock_rd_lock_wait_capped(rw_lock *rwl, rw_lock_owner owner,
+			    bool trylock, const struct timespec *abstime){
+    rw_lock_capped_reader self, *prev = NULL, *cur;
+    bool acquirable;
+    int rc = 0;
+
+    if (rwl->capped_readers_head == NULL && rw_lock_rd_lock_acquirable(rwl))
+	return true;
+    if (trylock)
+	return false;
+
+    if (pthread_cond_init(&self.cv, NULL) != 0){
+	perror("pthread_cond_init");
+	exit(-1);
+    }
+    self.next = NULL;
+    if (rwl->capped_readers_tail == NULL)
+	rwl->capped_readers_head = &self;
+    else
+	rwl->capped_readers_tail->next = &self;
+    rwl->capped_readers_tail = &self;
+
+    while(!(acquirable = rwl->capped_readers_head == &self &&
+	    rw_lock_rd_lock_acquirable(rwl)) && rc != ETIMEDOUT){
+	rwl->waiting_reader_threads++;
+	RW_LOCK_PROBE5(wait, rwl, RW_LOCK_READ, owner,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	if (abstime == NULL)
+	    pthread_cond_wait(&self.cv, &rwl->state_mutex);
+	else
+	    rc = pthread_cond_timedwait(&self.cv, &rwl->state_mutex, abstime);
+	RW_LOCK_PROBE3(wake, rwl, RW_LOCK_READ, owner);
+	rwl->waiting_reader_threads--;
+    }
+
+    /* Leave the FIFO, either from the head or on the timeout */
+    for (cur = rwl->capped_readers_head; cur != &self; cur = cur->next)
+	prev = cur;
+    if (prev == NULL)
+	rwl->capped_readers_head = self.next;
+    else
+	prev->next = self.next;
+    if (rwl->capped_readers_tail == &self)
+	rwl->capped_readers_tail = prev;
+
+    pthread_cond_destroy(&self.cv);
+
+    /*
+     * The next reader may take another free slot. This reader takes its
+     * slot before releasing the state mutex, so count it already.
+     */
+    if (prev == NULL &&
+	rwl->running_threads_in_CS + (acquirable ? 1 : 0) < rwl->max_readers)
+	rw_lock_signal_capped_reader(rwl);
+
+    return acquirable;
+}
+
+/*
+ * Wait until the read lock becomes acquirable. The caller holds the state
+ * mutex. Wait forever when 'abstime' is NULL, and don't wait at all when
+ * 'trylock' is true.
+ *
+ * Return false if the lock is still not acquirable at the timeout.
+ */
+static bool
+rw_lock_rd_lock_wait(rw_lock *rwl, rw_lock_owner owner,
+		     bool trylock, const struct timespec *abstime){
+    int rc = 0;
+
+    if (rwl->max_readers > 0)
+	return rw_lock_rd_lock_wait_capped(rwl, owner, trylock, abstime);
+
+    while(!rw_lock_rd_lock_acquirable(rwl)){
+	if (trylock || rc == ETIMEDOUT)
+	    return false;
+
+	rwl->waiting_reader_threads++;
+	RW_LOCK_PROBE5(wait, rwl, RW_LOCK_READ, owner,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	if (abstime == NULL)
+	    pthread_cond_wait(&rwl->state_cv, &rwl->state_mutex);
+	else
+	    rc = pthread_cond_timedwait(&rwl->state_cv, &rwl->state_mutex, abstime);
+	RW_LOCK_PROBE3(wake, rwl, RW_LOCK_READ, owner);
+	rwl->waiting_reader_threads--;
+    }
+
+    return true;
+}
+
+/*
+ * Same as rw_lock_rd_lock_wait(), but for the write lock.
+ */
+static bool
+rw_lock_wr_lock_wait(rw_lock *rwl, rw_lock_owner owner,
+		     bool trylock, const struct timespec *abstime){
+    int rc = 0;
+
+    while(!rw_lock_wr_lock_acquirable(rwl)){
+	if (trylock || rc == ETIMEDOUT)
+	    return false;
+
+	rwl->waiting_writer_threads++;
+	RW_LOCK_PROBE5(wait, rwl, RW_LOCK_WRITE, owner,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	if (abstime == NULL)
+	    pthread_cond_wait(&rwl->state_cv, &rwl->state_mutex);
+	else
+	    rc = pthread_cond_timedwait(&rwl->state_cv, &rwl->state_mutex, abstime);
+	RW_LOCK_PROBE3(wake, rwl, RW_LOCK_WRITE, owner);
+	rwl->waiting_writer_threads--;
+    }
+
+    return true;
 }
 
 /*
- * Find the self index from the reader thread manager.
- *
- * On failure, return -1.
+ * In the distributed mode, close the gate of the fast path and wait until
+ * the readers in the shards leave. On the timeout, reopen the gate and
+ * return false.
  */
-static int
-rw_lock_get_reader_index(rw_lock *rwl){
-    rec_rdt_manager *manager = &rwl->manager;
-    int index;
+static bool
+rw_lock_wr_lock_drain(rw_lock *rwl, rw_lock_owner owner,
+		      bool trylock, const struct timespec *abstime){
+    int rc = 0;
 
-    for (index = 0; index < manager->thread_total_no; index++){
-	if (manager->reader_thread_ids[index] == pthread_self()){
-	    return index;
+    if (rwl->repr != RW_LOCK_DISTRIBUTED)
+	return true;
+
+    rwl->writer_draining = true;
+    rw_lock_set_fast_readers_allowed(rwl, false);
+
+    while(rw_lock_shard_readers_present(rwl)){
+	if (trylock || rc == ETIMEDOUT){
+	    rwl->writer_draining = false;
+	    rw_lock_reopen_fast_path(rwl);
+	    pthread_cond_broadcast(&rwl->state_cv);
+	    return false;
 	}
+
+	rwl->waiting_writer_threads++;
+	RW_LOCK_PROBE5(wait, rwl, RW_LOCK_WRITE, owner,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	if (abstime == NULL)
+	    pthread_cond_wait(&rwl->state_cv, &rwl->state_mutex);
+	else
+	    rc = pthread_cond_timedwait(&rwl->state_cv, &rwl->state_mutex, abstime);
+	RW_LOCK_PROBE3(wake, rwl, RW_LOCK_WRITE, owner);
+	rwl->waiting_writer_threads--;
     }
 
-    return -1;
+    rwl->writer_draining = false;
+
+    return true;
 }
 
-rw_lock *
-rw_lock_init(unsigned int thread_total_no){
-    rw_lock *new_rwl;
-    int i;
+static bool
+rw_lock_rd_lock_common(rw_lock *rwl, rw_lock_owner owner,
+		       bool trylock, const struct timespec *abstime){
+    rw_lock_waiter *granted = NULL;
+    bool acquired = true;
 
-    my_assert(NULL, __FILE__, __LINE__, thread_total_no >= 0);
+    RW_LOCK_PROBE3(acquire_start, rwl, RW_LOCK_READ, owner);
 
-    if ((new_rwl = (rw_lock *) malloc(sizeof(rw_lock))) == NULL){
-	perror("malloc");
-	exit(-1);
-    }
+    if (rwl->class_index >= 0)
+	rw_lock_validate_acquire(rwl, owner, RW_LOCK_READ, trylock);
 
-    if (pthread_mutex_init(&new_rwl->state_mutex, NULL) != 0){
-	perror("pthread_mutex_init");
-	exit(-1);
+    /* Fast path of the distributed mode */
+    if (rw_lock_get_repr(rwl) == RW_LOCK_DISTRIBUTED &&
+	rw_lock_rd_lock_enter_shard(rwl, owner, true)){
+	if (rwl->class_index >= 0)
+	    rw_lock_validate_acquired(rwl, owner, RW_LOCK_READ);
+	return true;
     }
 
-    if (pthread_cond_init(&new_rwl->state_cv, NULL) != 0){
-	perror("pthread_cond_init");
-	exit(-1);
-    }
+    pthread_mutex_lock(&rwl->state_mutex);
 
-    /* Reader thread manager */
-    new_rwl->manager.thread_total_no = thread_total_no;
-    if ((new_rwl->manager.reader_threads_count_in_CS =
-	 (int *) malloc(sizeof(int) * thread_total_no)) == NULL){
-	perror("malloc");
-	exit(-1);
+    /*
+     * A reader which took the lock before the switch to the distributed
+     * mode must not wait for a writer draining the shards.
+     */
+    if (rwl->recursive && rw_lock_is_reader(&rwl->manager, owner))
+	rw_lock_rd_lock_enter_centralized(rwl, owner);
+    else if ((acquired = rw_lock_rd_lock_wait(rwl, owner, trylock, abstime)))
+	rw_lock_rd_lock_enter(rwl, owner);
+    else
+	RW_LOCK_PROBE3(acquire_failed, rwl, RW_LOCK_READ, owner);
+
+    /*
+     * The asynchronous readers wait behind the capped readers. Once the
+     * last of them has left the FIFO, let the former take the free slots.
+     */
+    if (rwl->max_readers > 0 && rwl->capped_readers_head == NULL)
+	granted = rw_lock_grant_async_waiters(rwl);
+
+    pthread_mutex_unlock(&rwl->state_mutex);
+
+    rw_lock_notify_async_waiters(rwl, granted);
+
+    if (acquired && rwl->class_index >= 0)
+	rw_lock_validate_acquired(rwl, owner, RW_LOCK_READ);
+
+    return acquired;
+}
+
+static bool
+rw_lock_wr_lock_common(rw_lock *rwl, rw_lock_owner owner,
+		       bool trylock, const struct timespec *abstime){
+    rw_lock_waiter *granted = NULL;
+    bool acquired;
+
+    RW_LOCK_PROBE3(acquire_start, rwl, RW_LOCK_WRITE, owner);
+
+    if (rwl->class_index >= 0)
+	rw_lock_validate_acquire(rwl, owner, RW_LOCK_WRITE, trylock);
+
+    pthread_mutex_lock(&rwl->state_mutex);
+
+    if (rw_lock_wr_lock_reenter(rwl, owner)){
+	pthread_mutex_unlock(&rwl->state_mutex);
+	if (rwl->class_index >= 0)
+	    rw_lock_validate_acquired(rwl, owner, RW_LOCK_WRITE);
+	return true;
     }
 
-    if ((new_rwl->manager.reader_thread_ids =
-	 (pthread_t *) malloc(sizeof(pthread_t) * thread_total_no)) == NULL){
-	perror("malloc");
-	exit(-1);
+    if ((acquired = rw_lock_wr_lock_wait(rwl, owner, trylock, abstime))){
+	if ((acquired = rw_lock_wr_lock_drain(rwl, owner, trylock, abstime)))
+	    rw_lock_wr_lock_enter(rwl, owner);
+	else
+	    granted = rw_lock_grant_async_waiters(rwl);
+    }else if (!trylock && rwl->fairness == RW_LOCK_PREFER_WRITERS &&
+	      rwl->waiting_writer_threads == 0){
+	/* The last waiting writer has timed out. Let the readers held back go */
+	granted = rw_lock_grant_async_waiters(rwl);
+	pthread_cond_broadcast(&rwl->state_cv);
+	rw_lock_signal_capped_reader(rwl);
     }
+    if (!acquired)
+	RW_LOCK_PROBE3(acquire_failed, rwl, RW_LOCK_WRITE, owner);
 
-    new_rwl->manager.insert_index = 0;
+    pthread_mutex_unlock(&rwl->state_mutex);
 
-    for (i = 0; i < thread_total_no; i++){
-	new_rwl->manager.reader_threads_count_in_CS[i] = 0;
-	new_rwl->manager.reader_thread_ids[i] = NULL;
-    }
+    rw_lock_notify_async_waiters(rwl, granted);
 
-    new_rwl->running_threads_in_CS = 0;
-    new_rwl->waiting_reader_threads = 0;
-    new_rwl->writer_recursive_count = 0;
-    new_rwl->waiting_writer_threads = 0;
-    new_rwl->is_locked_by_reader = false;
-    new_rwl->is_locked_by_writer = false;
-    new_rwl->writer_thread_in_CS = NULL;
+    if (acquired && rwl->class_index >= 0)
+	rw_lock_validate_acquired(rwl, owner, RW_LOCK_WRITE);
 
-    return new_rwl;
+    return acquired;
+}
+
+void
+rw_lock_rd_lock_owner(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_rd_lock_common(rwl, owner, false, NULL);
+}
+
+void
+rw_lock_wr_lock_owner(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_wr_lock_common(rwl, owner, false, NULL);
 }
 
 void
 rw_lock_rd_lock(rw_lock *rwl){
-    rec_rdt_manager *manager;
-    int index;
+    rw_lock_rd_lock_common(rwl, rw_lock_get_owner(), false, NULL);
+}
 
-    pthread_mutex_lock(&rwl->state_mutex);
+void
+rw_lock_wr_lock(rw_lock *rwl){
+    rw_lock_wr_lock_common(rwl, rw_lock_get_owner(), false, NULL);
+}
 
-    /*
-     * For any read operation, wait only if the lock is taken
-     * by a write thread.
-     *
-     * There is no need to check the reader related conditions
-     * in the below predicate, because even if other reader
-     * thread took a lock, it is harmless to set the flag of
-     * reader's lock true again (and also, to increment the
-     * number of reader threads).
-     */
-    while(rwl->writer_thread_in_CS && rwl->is_locked_by_writer){
-	rwl->waiting_reader_threads++;
-	pthread_cond_wait(&rwl->state_cv, &rwl->state_mutex);
-	rwl->waiting_reader_threads++;
+/*
+ * Take the read lock only if it's available without waiting.
+ *
+ * Return true on success.
+ */
+bool
+rw_lock_rd_trylock(rw_lock *rwl){
+    return rw_lock_rd_lock_common(rwl, rw_lock_get_owner(), true, NULL);
+}
+
+/*
+ * Take the write lock only if it's available without waiting.
+ * The recursive write lock always succeeds.
+ *
+ * Return true on success.
+ */
+bool
+rw_lock_wr_trylock(rw_lock *rwl){
+    return rw_lock_wr_lock_common(rwl, rw_lock_get_owner(), true, NULL);
+}
+
+/*
+ * Wait for the read lock until the absolute time 'abstime' (CLOCK_REALTIME).
+ *
+ * Return false on the timeout.
+ */
+bool
+rw_lock_rd_timedlock(rw_lock *rwl, const struct timespec *abstime){
+    return rw_lock_rd_lock_common(rwl, rw_lock_get_owner(), false, abstime);
+}
+
+/*
+ * Wait for the write lock until the absolute time 'abstime' (CLOCK_REALTIME).
+ *
+ * Return false on the timeout.
+ */
+bool
+rw_lock_wr_timedlock(rw_lock *rwl, const struct timespec *abstime){
+    return rw_lock_wr_lock_common(rwl, rw_lock_get_owner(), false, abstime);
+}
+
+/*
+ * Let the asynchronous request 'waiter' enter the C.S. if possible.
+ * Called with the state mutex held.
+ *
+ * In the distributed mode, a write request closes the gate and keeps it
+ * closed until the readers in the shards leave. The last reader leaving
+ * grants the request via rw_lock_notify_drained().
+ */
+static bool
+rw_lock_async_enter(rw_lock *rwl, rw_lock_waiter *waiter){
+    if (waiter->mode == RW_LOCK_READ){
+	/* Don't overtake the capped readers queued before */
+	if (!rw_lock_rd_lock_acquirable(rwl) || rwl->capped_readers_head != NULL)
+	    return false;
+	rw_lock_rd_lock_enter(rwl, waiter->owner);
+	return true;
     }
 
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->writer_thread_in_CS == NULL);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->is_locked_by_writer == false);
+    if ((rwl->writer_thread_in_CS && rwl->is_locked_by_writer) ||
+	(rwl->is_locked_by_reader && rwl->running_threads_in_CS > 0) ||
+	rwl->writer_draining)
+	return false;
 
-    /*
-     * Manage reader thread's count of the lock, including recursive ones
-     */
-    manager = &rwl->manager;
-    if ((index = rw_lock_get_reader_index(rwl)) == -1){
-	index = manager->insert_index;
-	manager->insert_index++;
+    if (rwl->repr == RW_LOCK_DISTRIBUTED){
+	rwl->async_writer_draining = true;
+	rw_lock_set_fast_readers_allowed(rwl, false);
+	if (rw_lock_shard_readers_present(rwl))
+	    return false;
     }
 
-    /*
-     * If this is a recursive lock, then increment the count
-     */
-    if (rwl->is_locked_by_reader &&
-	manager->reader_thread_ids[index] != NULL &&
-	manager->reader_threads_count_in_CS[index] != 0){
-	manager->reader_threads_count_in_CS[index]++;
-	printf("[%s] %p sets threads_count_in_CS[%d] = '%d' by recursive lock\n",
-	       __FUNCTION__, pthread_self(), index,
-	       manager->reader_threads_count_in_CS[index]);
-    }else{
-	/* Ensure this lock is a completely new lock */
-	my_assert(NULL, __FILE__, __LINE__,
-		  manager->reader_threads_count_in_CS[index] == 0);
+    rwl->async_writer_draining = false;
+    rw_lock_wr_lock_enter(rwl, waiter->owner);
 
-	rwl->running_threads_in_CS++;
-	rwl->is_locked_by_reader = true;
-	manager->reader_threads_count_in_CS[index] = 1;
-	manager->reader_thread_ids[index] = pthread_self();
+    return true;
+}
+
+/*
+ * Grant the lock to the queued asynchronous requests from the head, as long
+ * as the head request is compatible with the current lock state.
+ *
+ * Return the list of the granted requests, so that the caller can notify
+ * them after releasing the state mutex.
+ */
+static rw_lock_waiter *
+rw_lock_grant_async_waiters(rw_lock *rwl){
+    rw_lock_waiter *waiter, *granted_head = NULL, *granted_tail = NULL;
+
+    while((waiter = rwl->async_waiters_head) != NULL){
+	if (!rw_lock_async_enter(rwl, waiter))
+	    break;
 
-	printf("[%s] %p created threads_count_in_CS[%d] = '%d' by a new lock\n",
-	       __FUNCTION__, pthread_self(), index,
-	       manager->reader_threads_count_in_CS[index]);
+	rwl->async_waiters_head = waiter->next;
+	if (rwl->async_waiters_head == NULL)
+	    rwl->async_waiters_tail = NULL;
+
+	waiter->next = NULL;
+	if (granted_tail == NULL)
+	    granted_head = waiter;
+	else
+	    granted_tail->next = waiter;
+	granted_tail = waiter;
     }
 
-    pthread_mutex_unlock(&rwl->state_mutex);
+    return granted_head;
 }
 
-void
-rw_lock_wr_lock(rw_lock *rwl){
-    pthread_mutex_lock(&rwl->state_mutex);
+/*
+ * Notify the owners of the granted requests via their callbacks and eventfds.
+ * Must be called without holding the state mutex, since the callbacks
+ * may operate the same lock.
+ */
+static void
+rw_lock_notify_async_waiters(rw_lock *rwl, rw_lock_waiter *granted){
+    rw_lock_waiter *next;
+    uint64_t one = 1;
 
-    /* Support the recursive locking */
-    if (rwl->is_locked_by_writer && rwl->writer_thread_in_CS == pthread_self()){
-	my_assert(NULL, __FILE__, __LINE__,
-		  rwl->running_threads_in_CS == 1);
-	my_assert(NULL, __FILE__, __LINE__,
-		  rwl->is_locked_by_reader == false);
+    while(granted != NULL){
+	next = granted->next;
 
-	rwl->writer_recursive_count++;
-	printf("[%s] %p got a recursive lock (count = %d)\n",
-	       __FUNCTION__, pthread_self(), rwl->writer_recursive_count);
-	pthread_mutex_unlock(&rwl->state_mutex);
-	return;
+	RW_LOCK_PROBE3(wake, rwl, granted->mode, granted->owner);
+	if (granted->cb != NULL)
+	    granted->cb(rwl, granted->owner, granted->arg);
+
+	if (granted->efd >= 0 &&
+	    write(granted->efd, &one, sizeof(one)) != sizeof(one)){
+	    perror("write");
+	}
+
+	free(granted);
+	granted = next;
     }
+}
+
+/*
+ * Wake up the writer draining the shards after the last reader has left them.
+ * Also grant the asynchronous write request waiting for the drain.
+ */
+static void
+rw_lock_notify_drained(rw_lock *rwl){
+    rw_lock_waiter *granted = NULL;
+
+    pthread_mutex_lock(&rwl->state_mutex);
+    if (rwl->async_writer_draining)
+	granted = rw_lock_grant_async_waiters(rwl);
+    RW_LOCK_PROBE4(wakeup, rwl, 1,
+		   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+    pthread_cond_broadcast(&rwl->state_cv);
+    pthread_mutex_unlock(&rwl->state_mutex);
+
+    rw_lock_notify_async_waiters(rwl, granted);
+}
+
+/*
+ * The request granted immediately, which is the common case, needs no
+ * waiter. The waiter is allocated only to queue the request, under the
+ * state mutex so that the lock state checked stays valid.
+ */
+static bool
+rw_lock_lock_async(rw_lock *rwl, rw_lock_mode mode, rw_lock_owner owner,
+		   rw_lock_grant_cb cb, void *arg, int efd){
+    rw_lock_waiter request, *waiter;
+    bool acquired = false;
+
+    request.mode = mode;
+    request.owner = owner;
+
+    RW_LOCK_PROBE3(acquire_start, rwl, mode, owner);
+
+    pthread_mutex_lock(&rwl->state_mutex);
 
     /*
-     * For any new write operation, wait if the lock is
-     * taken by any other writer thread or if any reader thread
-     * is taking the lock.
+     * The recursive requests are granted immediately. Otherwise, respect the
+     * order of the other queued requests and take the lock only when there
+     * is no queued one.
      */
-    while((rwl->writer_thread_in_CS && rwl->is_locked_by_writer) ||
-	  (rwl->is_locked_by_reader && rwl->running_threads_in_CS > 0)){
-	rwl->waiting_writer_threads++;
-	pthread_cond_wait(&rwl->state_cv, &rwl->state_mutex);
-	rwl->waiting_writer_threads++;
-    }
+    if (mode == RW_LOCK_READ && rwl->recursive && rw_lock_rd_lock_held(rwl, owner)){
+	rw_lock_rd_lock_enter(rwl, owner);
+	acquired = true;
+    }else if (mode == RW_LOCK_WRITE && rw_lock_wr_lock_reenter(rwl, owner)){
+	acquired = true;
+    }else if (rwl->async_waiters_head == NULL && rw_lock_async_enter(rwl, &request)){
+	acquired = true;
+    }else{
+	if ((waiter = (rw_lock_waiter *) malloc(sizeof(rw_lock_waiter))) == NULL){
+	    perror("malloc");
+	    exit(-1);
+	}
 
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->writer_thread_in_CS == NULL);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->is_locked_by_reader == false);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->is_locked_by_writer == false);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->running_threads_in_CS == 0);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->writer_recursive_count == 0);
+	waiter->mode = mode;
+	waiter->owner = owner;
+	waiter->cb = cb;
+	waiter->arg = arg;
+	waiter->efd = efd;
+	waiter->next = NULL;
 
-    rwl->writer_recursive_count = 1;
-    rwl->running_threads_in_CS = 1;
-    rwl->is_locked_by_writer = true;
-    rwl->writer_thread_in_CS = pthread_self();
+	if (rwl->async_waiters_tail == NULL)
+	    rwl->async_waiters_head = waiter;
+	else
+	    rwl->async_waiters_tail->next = waiter;
+	rwl->async_waiters_tail = waiter;
+	RW_LOCK_PROBE5(wait, rwl, mode, owner,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+    }
 
     pthread_mutex_unlock(&rwl->state_mutex);
+
+    return acquired;
+}
+
+/*
+ * Request a read lock on behalf of 'owner' without blocking.
+ *
+ * Return true if the lock has been taken immediately. Otherwise, the request
+ * is queued and 'cb' is called and/or 'efd' is signaled once it is granted.
+ * Either way, release the lock by rw_lock_unlock_owner() with the same 'owner'.
+ */
+bool
+rw_lock_rd_lock_async(rw_lock *rwl, rw_lock_owner owner,
+		      rw_lock_grant_cb cb, void *arg, int efd){
+    return rw_lock_lock_async(rwl, RW_LOCK_READ, owner, cb, arg, efd);
+}
+
+/*
+ * Request a write lock on behalf of 'owner' without blocking.
+ * See rw_lock_rd_lock_async() also.
+ */
+bool
+rw_lock_wr_lock_async(rw_lock *rwl, rw_lock_owner owner,
+		      rw_lock_grant_cb cb, void *arg, int efd){
+    return rw_lock_lock_async(rwl, RW_LOCK_WRITE, owner, cb, arg, efd);
+}
+
+/*
+ * Wake up the waiting threads after the lock has been released.
+ */
+static void
+rw_lock_wakeup_waiters(rw_lock *rwl){
+    /* Send a signal only if there is any waiting threads */
+    if (rwl->waiting_reader_threads > 0 ||
+	rwl->waiting_writer_threads > 0){
+	RW_LOCK_PROBE4(wakeup, rwl,
+		       rwl->repr == RW_LOCK_DISTRIBUTED ||
+		       rwl->fairness == RW_LOCK_PREFER_WRITERS,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	/*
+	 * In the distributed mode, let all the readers take the lock. When
+	 * the writers are preferred, a woken reader may keep waiting for the
+	 * writers, so wake up the writers as well. The capped readers sleep
+	 * on their own, and only the head of their FIFO is woken.
+	 */
+	if (rwl->repr == RW_LOCK_DISTRIBUTED ||
+	    rwl->fairness == RW_LOCK_PREFER_WRITERS)
+	    pthread_cond_broadcast(&rwl->state_cv);
+	else
+	    pthread_cond_signal(&rwl->state_cv);
+	rw_lock_signal_capped_reader(rwl);
+    }
 }
 
 void
-rw_lock_unlock(rw_lock *rwl){
+rw_lock_unlock_owner(rw_lock *rwl, rw_lock_owner owner){
+    rw_lock_waiter *granted = NULL;
+
+    if (rwl->class_index >= 0)
+	rw_lock_validate_release(rwl, owner);
+
+    /* The read lock taken via the shard doesn't need the state mutex */
+    if (rw_lock_get_repr(rwl) == RW_LOCK_DISTRIBUTED &&
+	rw_lock_rd_unlock_shard(rwl, owner))
+	return;
+
     pthread_mutex_lock(&rwl->state_mutex);
 
     if (rwl->is_locked_by_writer){
 	my_assert(NULL, __FILE__, __LINE__,
-		  rwl->writer_thread_in_CS == pthread_self());
+		  rwl->writer_thread_in_CS == owner);
 	my_assert(NULL, __FILE__, __LINE__,
 		  rwl->running_threads_in_CS == 1);
 	my_assert(NULL, __FILE__, __LINE__,
@@ -240,27 +2039,43 @@ rw_lock_unlock(rw_lock *rwl){
 	 */
 	if (rwl->writer_recursive_count > 0){
 	    rwl->writer_recursive_count--;
-
-	    printf("[%s] %p released a recursive lock (recursive count = %d)\n",
-	       __FUNCTION__, pthread_self(), rwl->writer_recursive_count);
+	    RW_LOCK_PROBE6(release, rwl, RW_LOCK_WRITE, owner,
+			   rwl->writer_recursive_count,
+			   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
 
 	    /* This writer thread is done with recursive lock work */
 	    if (rwl->writer_recursive_count == 0){
 		rwl->running_threads_in_CS = 0;
 		rwl->is_locked_by_writer = false;
-		rwl->writer_thread_in_CS = NULL;
-		/* Send a signal only if there is any waiting threads */
-		if (rwl->waiting_reader_threads > 0 ||
-		    rwl->waiting_writer_threads > 0)
-		    pthread_cond_signal(&rwl->state_cv);
+		rwl->writer_thread_in_CS = 0;
+		rw_lock_adapt_to_reads(rwl);
+		rw_lock_reopen_fast_path(rwl);
+		granted = rw_lock_grant_async_waiters(rwl);
+		rw_lock_wakeup_waiters(rwl);
 	    }
 	}
+    }else if (rwl->is_locked_by_reader && !rwl->recursive){
+	/*
+	 * Without the recursion tracking, the readers are not told apart.
+	 * Just release one of the read locks.
+	 */
+	RW_LOCK_PROBE6(release, rwl, RW_LOCK_READ, owner, 0,
+		       rwl->waiting_reader_threads, rwl->waiting_writer_threads);
+	if (--rwl->running_threads_in_CS == 0){
+	    rwl->is_locked_by_reader = false;
+	    granted = rw_lock_grant_async_waiters(rwl);
+	    rw_lock_wakeup_waiters(rwl);
+	}else if (rwl->max_readers > 0){
+	    /* A slot has been freed for the capped readers */
+	    granted = rw_lock_grant_async_waiters(rwl);
+	    rw_lock_signal_capped_reader(rwl);
+	}
     }else if (rwl->is_locked_by_reader){
 	rec_rdt_manager *manager = &rwl->manager;
 	int index;
 
 	my_assert(NULL, __FILE__, __LINE__,
-		  rwl->writer_thread_in_CS == NULL);
+		  rwl->writer_thread_in_CS == 0);
 	my_assert(NULL, __FILE__, __LINE__,
 		  rwl->is_locked_by_writer == false);
 
@@ -275,26 +2090,32 @@ rw_lock_unlock(rw_lock *rwl){
 	 *
 	 * Raise an assertion failure.
 	 */
-	if ((index = rw_lock_get_reader_index(rwl)) == -1)
+	if ((index = rw_lock_get_reader_index(manager, owner)) == -1 ||
+	    manager->reader_threads_count_in_CS[index] == 0)
 	    my_assert(NULL, __FILE__, __LINE__, 0);
 
-	if (manager->reader_threads_count_in_CS[index] - 1 > 1){
+	if (manager->reader_threads_count_in_CS[index] > 1){
 	    /* This thread utilizes the recursive unlock. Decrement the count */
 	    manager->reader_threads_count_in_CS[index]--;
+	    RW_LOCK_PROBE6(release, rwl, RW_LOCK_READ, owner,
+			   manager->reader_threads_count_in_CS[index],
+			   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
 	}else{
 	    /* This thread is done with its work in the C.S. section */
 	    rwl->running_threads_in_CS--;
 	    manager->reader_threads_count_in_CS[index] = 0;
-	    printf("[%s] %p has released all its reader locks\n",
-		   __FUNCTION__, pthread_self());
+	    RW_LOCK_PROBE6(release, rwl, RW_LOCK_READ, owner, 0,
+			   rwl->waiting_reader_threads, rwl->waiting_writer_threads);
 
+	    rw_lock_adapt_to_reads(rwl);
 	    if (rwl->running_threads_in_CS == 0){
 		rwl->is_locked_by_reader = false;
-
-		/* Send a signal only if there is any waiting threads */
-		if (rwl->waiting_reader_threads > 0 ||
-		    rwl->waiting_writer_threads > 0)
-		    pthread_cond_signal(&rwl->state_cv);
+		granted = rw_lock_grant_async_waiters(rwl);
+		rw_lock_wakeup_waiters(rwl);
+	    }else if (rwl->max_readers > 0){
+		/* A slot has been freed for the capped readers */
+		granted = rw_lock_grant_async_waiters(rwl);
+		rw_lock_signal_capped_reader(rwl);
 	    }
 	}
     }else{
@@ -309,31 +2130,103 @@ rw_lock_unlock(rw_lock *rwl){
 	my_assert(NULL, __FILE__, __LINE__, 0);
     }
     pthread_mutex_unlock(&rwl->state_mutex);
+
+    rw_lock_notify_async_waiters(rwl, granted);
 }
 
 void
-rw_lock_destroy(rw_lock *rwl){
+rw_lock_unlock(rw_lock *rwl){
+    rw_lock_unlock_owner(rwl, rw_lock_get_owner());
+}
+
+/*
+ * Raise the assertion failure unless the lock is free and can be destroyed.
+ * Return false, so that the caller leaves the lock intact, if the failure
+ * handler returns.
+ */
+static bool
+rw_lock_check_destroyable(rw_lock *rwl){
+    bool destroyable;
     int i;
 
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->running_threads_in_CS == 0);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->waiting_reader_threads == 0);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->waiting_writer_threads == 0);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->writer_recursive_count == 0);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->is_locked_by_reader == false);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->is_locked_by_writer == false);
-    my_assert(NULL, __FILE__, __LINE__,
-	      rwl->writer_thread_in_CS == NULL);
-    for (i = 0; i < rwl->manager.thread_total_no; i++){
-	my_assert(NULL, __FILE__, __LINE__,
-		  rwl->manager.reader_threads_count_in_CS[i] == 0);
-    }
+    destroyable = rwl->running_threads_in_CS == 0 &&
+	rwl->waiting_reader_threads == 0 &&
+	rwl->waiting_writer_threads == 0 &&
+	rwl->writer_recursive_count == 0 &&
+	rwl->is_locked_by_reader == false &&
+	rwl->is_locked_by_writer == false &&
+	rwl->writer_thread_in_CS == 0 &&
+	rwl->async_waiters_head == NULL &&
+	rwl->capped_readers_head == NULL;
+    for (i = 0; destroyable && i < rwl->manager.thread_total_no; i++)
+	destroyable = rwl->manager.reader_threads_count_in_CS[i] == 0;
+    if (destroyable && rwl->shards != NULL)
+	destroyable = !rw_lock_shard_readers_present(rwl);
 
+    my_assert("Destroying the lock in use", __FILE__, __LINE__, destroyable);
+
+    return destroyable;
+}
+
+static void
+rw_lock_teardown(rw_lock *rwl){
+    rw_lock_free_shards(rwl);
     pthread_cond_destroy(&rwl->state_cv);
     pthread_mutex_destroy(&rwl->state_mutex);
 }
+
+/*
+ * Destroy the lock and release its memory. A lock carved from a pool
+ * returns to the pool.
+ */
+void
+rw_lock_destroy(rw_lock *rwl){
+    rw_lock_pool *pool = rwl->pool;
+
+    if (!rw_lock_check_destroyable(rwl))
+	return;
+    rw_lock_teardown(rwl);
+
+    if (pool != NULL){
+	pthread_mutex_lock(&pool->pool_mutex);
+	rw_lock_pool_put(pool, rwl);
+	pthread_mutex_unlock(&pool->pool_mutex);
+    }else{
+	free(rwl);
+    }
+}
+
+/*
+ * Destroy 'locks_no' locks in 'locks' at once. None of them is destroyed
+ * if any of them is still in use. The consecutive locks of the same pool
+ * are returned to the pool under one acquisition of the pool mutex.
+ */
+void
+rw_lock_destroy_locks(rw_lock **locks, unsigned int locks_no){
+    rw_lock_pool *pool = NULL;
+    int i;
+
+    for (i = 0; i < locks_no; i++){
+	if (!rw_lock_check_destroyable(locks[i]))
+	    return;
+    }
+
+    for (i = 0; i < locks_no; i++){
+	rw_lock_teardown(locks[i]);
+
+	if (locks[i]->pool != pool){
+	    if (pool != NULL)
+		pthread_mutex_unlock(&pool->pool_mutex);
+	    if ((pool = locks[i]->pool) != NULL)
+		pthread_mutex_lock(&pool->pool_mutex);
+	}
+
+	if (pool != NULL)
+	    rw_lock_pool_put(pool, locks[i]);
+	else
+	    free(locks[i]);
+    }
+
+    if (pool != NULL)
+	pthread_mutex_unlock(&pool->pool_mutex);
+}
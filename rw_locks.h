@@ -5,6 +5,105 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Identifier of the lock holder, such as a task or coroutine id.
+ * By default, the calling thread's pthread_self() is the owner.
+ * Zero is reserved for "no owner".
+ */
+typedef uintptr_t rw_lock_owner;
+
+typedef enum rw_lock_mode {
+    RW_LOCK_READ,
+    RW_LOCK_WRITE
+} rw_lock_mode;
+
+/*
+ * Representation of the reader tracking. See rw_lock_attr.
+ */
+typedef enum rw_lock_repr {
+    /* All the readers are counted in the rw_lock itself under the mutex */
+    RW_LOCK_CENTRALIZED,
+    /* The readers are counted in the shards selected by their owners */
+    RW_LOCK_DISTRIBUTED
+} rw_lock_repr;
+
+/*
+ * Which waiting threads are preferred when the lock is released.
+ */
+typedef enum rw_lock_fairness {
+    /* New readers may join the readers in the C.S. even if writers wait */
+    RW_LOCK_PREFER_READERS,
+    /* New readers wait while any writer is waiting */
+    RW_LOCK_PREFER_WRITERS
+} rw_lock_fairness;
+
+/*
+ * Options of rw_lock_init_attr(). Initialize this by rw_lock_attr_init().
+ */
+typedef struct rw_lock_attr {
+    /*
+     * Track the recent read/write ratio and switch the reader tracking
+     * to the distributed mode while the reads dominate. Requires 'recursive'.
+     */
+    bool adaptive;
+    /*
+     * Track the owners of the locks to support the recursive locking and
+     * to detect the invalid unlocking. When this is false, a recursive lock
+     * deadlocks and any owner may release a read lock.
+     */
+    bool recursive;
+    rw_lock_fairness fairness;
+    /*
+     * Name of the lock class for the lock-order validator, or NULL not to
+     * validate the lock. The locks given equal strings share the class. The
+     * name is copied, so it may be built at runtime.
+     */
+    const char *lock_class;
+    /*
+     * Maximum number of the readers in the C.S. at a time, or 0 for no
+     * limit. The excess readers wait in FIFO order for a free slot. The
+     * recursive read locks don't take another slot. Can't be combined with
+     * 'adaptive'.
+     */
+    unsigned int max_readers;
+} rw_lock_attr;
+
+struct rw_lock;
+struct rw_lock_reader_shard;
+struct rw_lock_snzi_node;
+struct rw_lock_capped_reader;
+
+/*
+ * Pool of the locks sharing the same attributes. The locks are carved from
+ * cache-aligned slabs together with their reader tracking state, and are
+ * recycled on rw_lock_destroy().
+ */
+typedef struct rw_lock_pool rw_lock_pool;
+
+/*
+ * Called once the queued asynchronous request has been granted the lock.
+ * Runs in the thread that released the lock, outside of the state mutex.
+ */
+typedef void (*rw_lock_grant_cb)(struct rw_lock *rwl, rw_lock_owner owner,
+				 void *arg);
+
+/*
+ * Asynchronous lock request queued until the lock becomes available.
+ */
+typedef struct rw_lock_waiter {
+    rw_lock_mode mode;
+    rw_lock_owner owner;
+    rw_lock_grant_cb cb;
+    void *arg;
+    /* eventfd to be signaled on the grant, or -1 */
+    int efd;
+    struct rw_lock_waiter *next;
+} rw_lock_waiter;
+
 /*
  * Recursive reader threads manager required to check
  * invalid unlocking.
@@ -17,7 +116,7 @@ typedef struct rec_rdt_manager {
      * For the first (non-recursive) lock, set one to each thread count.
      */
     int *reader_threads_count_in_CS;
-    pthread_t *reader_thread_ids;
+    rw_lock_owner *reader_thread_ids;
 } rec_rdt_manager;
 
 typedef struct rw_lock {
@@ -27,18 +126,81 @@ typedef struct rw_lock {
     uint16_t waiting_writer_threads;
     bool is_locked_by_reader;
     bool is_locked_by_writer;
-    pthread_t writer_thread_in_CS;
+    rw_lock_owner writer_thread_in_CS;
     rec_rdt_manager manager;
+    /* FIFO of the asynchronous requests */
+    rw_lock_waiter *async_waiters_head;
+    rw_lock_waiter *async_waiters_tail;
+    bool recursive;
+    rw_lock_fairness fairness;
+    /* Cap of the readers in the C.S. and the FIFO of the excess readers */
+    uint16_t max_readers;
+    struct rw_lock_capped_reader *capped_readers_head;
+    struct rw_lock_capped_reader *capped_readers_tail;
+    /* Adaptive switch of the reader tracking */
+    bool adaptive;
+    rw_lock_repr repr;
+    /* The readers may take the lock via their shards without the mutex */
+    bool fast_readers_allowed;
+    /* A writer waits for the readers in the shards to leave */
+    bool writer_draining;
+    bool async_writer_draining;
+    struct rw_lock_reader_shard *shards;
+    /* Non-zero while any reader holds the lock via the shards */
+    struct rw_lock_snzi_node *snzi_root;
+    /* Statistics of the current adaptive window */
+    uint32_t window_reads;
+    uint32_t window_shared_reads;
+    uint32_t window_writes;
+    /* The pool this lock is carved from, or NULL */
+    rw_lock_pool *pool;
+    /* Class of the lock-order validator, or -1 */
+    int class_index;
     pthread_cond_t state_cv;
     pthread_mutex_t state_mutex;
 } rw_lock;
 
-void my_assert(char *description, char *filename, int lineno, int expr);
+void my_assert(const char *description, const char *filename, int lineno, int expr);
 
+void rw_lock_attr_init(rw_lock_attr *attr);
 rw_lock *rw_lock_init(unsigned int thread_total_no);
+rw_lock *rw_lock_init_attr(unsigned int thread_total_no, const rw_lock_attr *attr);
 void rw_lock_rd_lock(rw_lock *rwl);
 void rw_lock_wr_lock(rw_lock *rwl);
 void rw_lock_unlock(rw_lock *rwl);
 void rw_lock_destroy(rw_lock *rwl);
 
+/* Lock pools and bulk initialization/destruction */
+rw_lock_pool *rw_lock_pool_create(unsigned int thread_total_no,
+				  const rw_lock_attr *attr,
+				  unsigned int slab_locks_no);
+rw_lock *rw_lock_pool_init_lock(rw_lock_pool *pool);
+void rw_lock_pool_init_locks(rw_lock_pool *pool, rw_lock **locks,
+			     unsigned int locks_no);
+void rw_lock_destroy_locks(rw_lock **locks, unsigned int locks_no);
+void rw_lock_pool_destroy(rw_lock_pool *pool);
+
+/* Non-blocking and bounded waiting interfaces */
+bool rw_lock_rd_trylock(rw_lock *rwl);
+bool rw_lock_wr_trylock(rw_lock *rwl);
+bool rw_lock_rd_timedlock(rw_lock *rwl, const struct timespec *abstime);
+bool rw_lock_wr_timedlock(rw_lock *rwl, const struct timespec *abstime);
+
+/* Ownership keyed on an explicit owner handle */
+void rw_lock_set_owner(rw_lock_owner owner);
+rw_lock_owner rw_lock_get_owner(void);
+void rw_lock_rd_lock_owner(rw_lock *rwl, rw_lock_owner owner);
+void rw_lock_wr_lock_owner(rw_lock *rwl, rw_lock_owner owner);
+void rw_lock_unlock_owner(rw_lock *rwl, rw_lock_owner owner);
+
+/* Asynchronous interfaces for event loops */
+bool rw_lock_rd_lock_async(rw_lock *rwl, rw_lock_owner owner,
+			   rw_lock_grant_cb cb, void *arg, int efd);
+bool rw_lock_wr_lock_async(rw_lock *rwl, rw_lock_owner owner,
+			   rw_lock_grant_cb cb, void *arg, int efd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,248 @@
+#ifndef __RW_LOCKS_HPP__
+#define __RW_LOCKS_HPP__
+
+/*
+ * C++ wrappers of rw_lock satisfying the SharedTimedMutex named requirement,
+ * so that they work with std::unique_lock, std::shared_lock and
+ * std::scoped_lock.
+ *
+ * The features are selected by the policy at compile time. The disabled
+ * ones leave neither code nor data behind.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <sched.h>
+#include "rw_locks.h"
+
+namespace rw_locks {
+
+enum class fairness {
+    prefer_readers = RW_LOCK_PREFER_READERS,
+    prefer_writers = RW_LOCK_PREFER_WRITERS
+};
+
+/*
+ * Fairness          : which waiting threads are preferred on the release
+ * SpinBudget        : number of the retries before sleeping on the lock
+ * RecursionTracking : support the recursive locking and detect the invalid
+ *                     unlocking, with the per-owner bookkeeping
+ * Stats             : count the acquisitions and the contended ones
+ * MaxThreads        : number of the owners which may hold the lock at a
+ *                     time, when the recursion is tracked. One more owner
+ *                     raises the assertion failure (SIGUSR1)
+ *
+ * Without the recursion tracking, the number of the readers is not limited.
+ */
+template <fairness Fairness = fairness::prefer_readers,
+	  unsigned int SpinBudget = 0,
+	  bool RecursionTracking = false,
+	  bool Stats = false,
+	  unsigned int MaxThreads = 64>
+struct policy {
+    static constexpr fairness fairness_v = Fairness;
+    static constexpr unsigned int spin_budget = SpinBudget;
+    static constexpr bool recursion_tracking = RecursionTracking;
+    static constexpr bool stats = Stats;
+    static constexpr unsigned int max_threads = MaxThreads;
+};
+
+struct lock_stats {
+    std::uint64_t exclusive_acquisitions;
+    std::uint64_t shared_acquisitions;
+    /* The acquisitions which didn't get the lock at the first attempt */
+    std::uint64_t contended_acquisitions;
+};
+
+namespace detail {
+
+template <bool Enabled>
+class stats_counters {
+protected:
+    void count(bool, bool) noexcept {}
+};
+
+template <>
+class stats_counters<true> {
+public:
+    lock_stats stats() const noexcept {
+	return lock_stats{exclusive_.load(std::memory_order_relaxed),
+			  shared_.load(std::memory_order_relaxed),
+			  contended_.load(std::memory_order_relaxed)};
+    }
+
+protected:
+    void count(bool shared, bool contended) noexcept {
+	(shared ? shared_ : exclusive_).fetch_add(1, std::memory_order_relaxed);
+	if (contended)
+	    contended_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<std::uint64_t> exclusive_{0};
+    std::atomic<std::uint64_t> shared_{0};
+    std::atomic<std::uint64_t> contended_{0};
+};
+
+/*
+ * Convert the time point of any clock to the CLOCK_REALTIME deadline
+ * expected by rw_lock_rd_timedlock() and rw_lock_wr_timedlock().
+ */
+template <class Clock, class Duration>
+struct timespec
+to_realtime(const std::chrono::time_point<Clock, Duration> &abs_time){
+    auto rel = abs_time - Clock::now();
+    auto deadline = std::chrono::system_clock::now() +
+	std::chrono::duration_cast<std::chrono::system_clock::duration>(rel);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	deadline.time_since_epoch()).count();
+    struct timespec ts;
+
+    ts.tv_sec = static_cast<std::time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+
+    return ts;
+}
+
+} /* namespace detail */
+
+template <class Policy = policy<>>
+class basic_shared_mutex : public detail::stats_counters<Policy::stats> {
+public:
+    using policy_type = Policy;
+
+    basic_shared_mutex(){
+	rw_lock_attr attr;
+
+	rw_lock_attr_init(&attr);
+	attr.recursive = Policy::recursion_tracking;
+	attr.fairness = static_cast<rw_lock_fairness>(Policy::fairness_v);
+	rwl_ = rw_lock_init_attr(Policy::recursion_tracking ? Policy::max_threads : 0,
+				 &attr);
+    }
+
+    ~basic_shared_mutex(){
+	rw_lock_destroy(rwl_);
+    }
+
+    basic_shared_mutex(const basic_shared_mutex &) = delete;
+    basic_shared_mutex &operator=(const basic_shared_mutex &) = delete;
+
+    void lock() noexcept {
+	bool contended = false;
+
+	if constexpr (Policy::spin_budget > 0 || Policy::stats){
+	    if (!spin(&rw_lock_wr_trylock)){
+		contended = true;
+		rw_lock_wr_lock(rwl_);
+	    }
+	}else{
+	    rw_lock_wr_lock(rwl_);
+	}
+	this->count(false, contended);
+    }
+
+    bool try_lock() noexcept {
+	return counted(rw_lock_wr_trylock(rwl_), false);
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period> &rel_time){
+	return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration> &abs_time){
+	struct timespec ts = detail::to_realtime(abs_time);
+
+	return counted(rw_lock_wr_timedlock(rwl_, &ts), false);
+    }
+
+    void unlock() noexcept {
+	rw_lock_unlock(rwl_);
+    }
+
+    void lock_shared() noexcept {
+	bool contended = false;
+
+	if constexpr (Policy::spin_budget > 0 || Policy::stats){
+	    if (!spin(&rw_lock_rd_trylock)){
+		contended = true;
+		rw_lock_rd_lock(rwl_);
+	    }
+	}else{
+	    rw_lock_rd_lock(rwl_);
+	}
+	this->count(true, contended);
+    }
+
+    bool try_lock_shared() noexcept {
+	return counted(rw_lock_rd_trylock(rwl_), true);
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period> &rel_time){
+	return try_lock_shared_until(std::chrono::steady_clock::now() + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration> &abs_time){
+	struct timespec ts = detail::to_realtime(abs_time);
+
+	return counted(rw_lock_rd_timedlock(rwl_, &ts), true);
+    }
+
+    void unlock_shared() noexcept {
+	rw_lock_unlock(rwl_);
+    }
+
+    rw_lock *native_handle() noexcept {
+	return rwl_;
+    }
+
+private:
+    /*
+     * Try the lock once plus 'spin_budget' times, yielding the CPU in
+     * between. Return true if the lock has been taken.
+     */
+    bool spin(bool (*trylock)(rw_lock *)) noexcept {
+	if (trylock(rwl_))
+	    return true;
+
+	for (unsigned int i = 0; i < Policy::spin_budget; i++){
+	    sched_yield();
+	    if (trylock(rwl_))
+		return true;
+	}
+
+	return false;
+    }
+
+    bool counted(bool acquired, bool shared) noexcept {
+	if (acquired)
+	    this->count(shared, false);
+
+	return acquired;
+    }
+
+    rw_lock *rwl_;
+};
+
+/*
+ * Drop-in replacement of std::shared_mutex. No bookkeeping of the owners, so
+ * any number of threads may share it, but it doesn't recurse.
+ */
+using shared_mutex = basic_shared_mutex<>;
+
+/*
+ * Same behavior as the plain rw_lock. Recursive, but at most 64 threads may
+ * hold it at a time. Choose MaxThreads by the policy for more.
+ */
+using recursive_shared_mutex =
+    basic_shared_mutex<policy<fairness::prefer_readers, 0, true>>;
+
+} /* namespace rw_locks */
+
+#endif
@@ -1,9 +1,13 @@
 #include <assert.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include "rw_epoch.h"
 #include "rw_locks.h"
 
 /*
@@ -214,6 +218,7 @@ rec_read_thread_cb(void *arg){
 	rw_lock_unlock(unique->rwl);
 	rw_lock_unlock(unique->rwl);
 	rw_lock_unlock(unique->rwl);
+	rw_lock_unlock(unique->rwl);
 	printf("[%s] (id = %d & pthread_id = %p) has left C.S. with %d threads\n",
 	       __FUNCTION__, unique->thread_id, pthread_self(),
 	       unique->rwl->running_threads_in_CS);
@@ -272,6 +277,616 @@ rec_rw_threads_test(void){
 
 /* -------- <SECOND TEST END> -------- */
 
+/* -------- <THIRD TEST START> -------- */
+
+static int granted_count;
+
+static void
+async_granted_cb(rw_lock *rwl, rw_lock_owner owner, void *arg){
+    rw_lock_owner *expected_owner = (rw_lock_owner *) arg;
+
+    my_assert("Check if the callback is called for the queued owner",
+	      __FILE__, __LINE__, owner == *expected_owner);
+    granted_count++;
+}
+
+static void
+async_rw_lock_test(void){
+    rw_lock *rwl;
+    rw_lock_owner writer = 1, reader1 = 2, reader2 = 3;
+    uint64_t value;
+    int efd;
+
+    prepare_assertion_failure();
+
+    if ((efd = eventfd(0, EFD_NONBLOCK)) == -1){
+	perror("eventfd");
+	exit(-1);
+    }
+    rwl = rw_lock_init(2);
+
+    /* No one is taking the lock. The writer gets it immediately */
+    my_assert("The async write lock on a free rw-lock gets it immediately",
+	      __FILE__, __LINE__,
+	      rw_lock_wr_lock_async(rwl, writer, NULL, NULL, -1));
+    my_assert("The async recursive write lock gets it immediately",
+	      __FILE__, __LINE__,
+	      rw_lock_wr_lock_async(rwl, writer, NULL, NULL, -1));
+
+    /* Both readers need to wait for the writer */
+    my_assert("The async read lock is queued during the write lock",
+	      __FILE__, __LINE__,
+	      !rw_lock_rd_lock_async(rwl, reader1, async_granted_cb, &reader1, -1));
+    my_assert("The async read lock is queued during the write lock",
+	      __FILE__, __LINE__,
+	      !rw_lock_rd_lock_async(rwl, reader2, NULL, NULL, efd));
+    my_assert("The eventfd is not signaled before the grant",
+	      __FILE__, __LINE__,
+	      read(efd, &value, sizeof(value)) == -1);
+
+    /* The release of the recursive lock keeps holding it */
+    rw_lock_unlock_owner(rwl, writer);
+    my_assert("The queued readers are not granted during the write lock",
+	      __FILE__, __LINE__, granted_count == 0);
+
+    rw_lock_unlock_owner(rwl, writer);
+    my_assert("The queued reader's callback is called by the release",
+	      __FILE__, __LINE__, granted_count == 1);
+    my_assert("The queued reader's eventfd is signaled by the release",
+	      __FILE__, __LINE__,
+	      read(efd, &value, sizeof(value)) == sizeof(value) && value == 1);
+    my_assert("Both readers are in the C.S.",
+	      __FILE__, __LINE__, rwl->running_threads_in_CS == 2);
+
+    rw_lock_unlock_owner(rwl, reader1);
+    rw_lock_unlock_owner(rwl, reader2);
+    rw_lock_destroy(rwl);
+    close(efd);
+}
+
+/* -------- <THIRD TEST END> -------- */
+
+/* -------- <FOURTH TEST START> -------- */
+
+#define MIGRATED_TASK_ID 0x1234
+
+/*
+ * The next stage of the pipeline resumes the task and releases the locks
+ * the task took in the previous stage, which ran on another thread.
+ */
+static void *
+next_stage_thread_cb(void *arg){
+    rw_lock *rwl = (rw_lock *) arg;
+
+    rw_lock_set_owner(MIGRATED_TASK_ID);
+
+    /* Release the recursive write lock */
+    rw_lock_unlock(rwl);
+    my_assert("Check if the task keeps holding the write lock",
+	      __FILE__, __LINE__, rwl->writer_recursive_count == 1);
+    rw_lock_unlock(rwl);
+    my_assert("Check if the task has released the write lock",
+	      __FILE__, __LINE__, rwl->running_threads_in_CS == 0);
+
+    /* Take the read lock, which will be released by the main thread */
+    rw_lock_rd_lock(rwl);
+    rw_lock_rd_lock(rwl);
+
+    rw_lock_set_owner(0);
+
+    return NULL;
+}
+
+static void
+owner_handoff_test(void){
+    pthread_t next_stage;
+    rw_lock *rwl;
+
+    prepare_assertion_failure();
+
+    rwl = rw_lock_init(1);
+
+    rw_lock_set_owner(MIGRATED_TASK_ID);
+    my_assert("Check if the thread acts for the task",
+	      __FILE__, __LINE__, rw_lock_get_owner() == MIGRATED_TASK_ID);
+    rw_lock_wr_lock(rwl);
+    rw_lock_wr_lock_owner(rwl, MIGRATED_TASK_ID);
+    rw_lock_set_owner(0);
+    my_assert("Check if the thread is the owner by default",
+	      __FILE__, __LINE__, rw_lock_get_owner() == (rw_lock_owner) pthread_self());
+
+    if (pthread_create(&next_stage, NULL, next_stage_thread_cb, rwl) != 0){
+	perror("pthread_create");
+	exit(-1);
+    }
+    pthread_join(next_stage, NULL);
+
+    my_assert("Check if the task holds the read lock",
+	      __FILE__, __LINE__, rwl->running_threads_in_CS == 1);
+    rw_lock_unlock_owner(rwl, MIGRATED_TASK_ID);
+    rw_lock_unlock_owner(rwl, MIGRATED_TASK_ID);
+    rw_lock_destroy(rwl);
+}
+
+static void *
+release_task_lock_cb(void *arg){
+    rw_lock_unlock_owner((rw_lock *) arg, MIGRATED_TASK_ID);
+
+    return NULL;
+}
+
+/*
+ * The lock-order validator follows the locks released by another thread on
+ * behalf of the task.
+ */
+static void
+validated_owner_handoff_test(void){
+    pthread_t next_stage;
+    rw_lock_attr attr;
+    rw_lock *rwl_x, *rwl_y;
+
+    prepare_assertion_failure();
+
+    rw_lock_attr_init(&attr);
+    attr.lock_class = "handoff X";
+    rwl_x = rw_lock_init_attr(2, &attr);
+    attr.lock_class = "handoff Y";
+    rwl_y = rw_lock_init_attr(2, &attr);
+
+    rw_lock_rd_lock_owner(rwl_x, MIGRATED_TASK_ID);
+    if (pthread_create(&next_stage, NULL, release_task_lock_cb, rwl_x) != 0){
+	perror("pthread_create");
+	exit(-1);
+    }
+    pthread_join(next_stage, NULL);
+
+    /* Neither an upgrade of X nor the order X -> Y is reported */
+    rw_lock_wr_lock(rwl_x);
+    rw_lock_unlock(rwl_x);
+    rw_lock_wr_lock(rwl_y);
+    rw_lock_wr_lock(rwl_x);
+    rw_lock_unlock(rwl_x);
+    rw_lock_unlock(rwl_y);
+
+    rw_lock_destroy(rwl_x);
+    rw_lock_destroy(rwl_y);
+}
+
+typedef struct thread_release_arg {
+    rw_lock *rwl;
+    rw_lock_owner owner;
+} thread_release_arg;
+
+static void *
+release_thread_lock_cb(void *arg){
+    thread_release_arg *release = (thread_release_arg *) arg;
+
+    rw_lock_unlock_owner(release->rwl, release->owner);
+
+    return NULL;
+}
+
+/*
+ * The lock taken by a thread with the default ownership and released by
+ * another thread on its behalf leaves the stack of the first thread.
+ */
+static void
+validated_thread_release_test(void){
+    thread_release_arg release;
+    pthread_t releaser;
+    rw_lock_attr attr;
+    rw_lock *rwl;
+
+    prepare_assertion_failure();
+
+    rw_lock_attr_init(&attr);
+    attr.lock_class = "released by another thread";
+    rwl = rw_lock_init_attr(2, &attr);
+
+    rw_lock_rd_lock(rwl);
+    release.rwl = rwl;
+    release.owner = rw_lock_get_owner();
+    if (pthread_create(&releaser, NULL, release_thread_lock_cb, &release) != 0){
+	perror("pthread_create");
+	exit(-1);
+    }
+    pthread_join(releaser, NULL);
+
+    /* Not reported as an upgrade of the released read lock */
+    rw_lock_wr_lock(rwl);
+    rw_lock_unlock(rwl);
+
+    rw_lock_destroy(rwl);
+}
+
+/* -------- <FOURTH TEST END> -------- */
+
+/* -------- <FIFTH TEST START> -------- */
+
+#define READER_TASK_A 0x10
+#define READER_TASK_B 0x20
+
+static void
+adaptive_rw_lock_test(void){
+    rw_lock_attr attr;
+    rw_lock *rwl;
+    int i;
+
+    prepare_assertion_failure();
+
+    rw_lock_attr_init(&attr);
+    attr.adaptive = true;
+    rwl = rw_lock_init_attr(16, &attr);
+    my_assert("Check if the lock starts centralized",
+	      __FILE__, __LINE__, rwl->repr == RW_LOCK_CENTRALIZED);
+
+    /* Overlapping reads dominate, so the lock should become distributed */
+    for (i = 0; i < 600; i++){
+	rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+	rw_lock_rd_lock_owner(rwl, READER_TASK_B);
+	rw_lock_rd_lock_owner(rwl, READER_TASK_B);
+	rw_lock_unlock_owner(rwl, READER_TASK_B);
+	rw_lock_unlock_owner(rwl, READER_TASK_B);
+	rw_lock_unlock_owner(rwl, READER_TASK_A);
+    }
+    my_assert("Check if the lock has switched to the distributed mode",
+	      __FILE__, __LINE__, rwl->repr == RW_LOCK_DISTRIBUTED);
+
+    /* A writer must notice the readers spread over the shards */
+    for (i = 1; i <= 16; i++)
+	rw_lock_rd_lock_owner(rwl, i * READER_TASK_A);
+    for (i = 1; i <= 16; i++){
+	my_assert("Check if the writer waits for the readers in the shards",
+		  __FILE__, __LINE__, rw_lock_wr_trylock(rwl) == false);
+	rw_lock_unlock_owner(rwl, i * READER_TASK_A);
+    }
+    my_assert("Check if the writer gets the lock after the readers left",
+	      __FILE__, __LINE__, rw_lock_wr_trylock(rwl) == true);
+    rw_lock_unlock(rwl);
+
+    /* The writes dominate now, so the lock should get back to centralized */
+    for (i = 0; i < 1100; i++){
+	rw_lock_wr_lock_owner(rwl, READER_TASK_A);
+	rw_lock_unlock_owner(rwl, READER_TASK_A);
+    }
+    my_assert("Check if the lock has switched back to the centralized mode",
+	      __FILE__, __LINE__, rwl->repr == RW_LOCK_CENTRALIZED);
+
+    /* The recursive readers still work after the round trip */
+    rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+    rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+    rw_lock_unlock_owner(rwl, READER_TASK_A);
+    rw_lock_unlock_owner(rwl, READER_TASK_A);
+    rw_lock_destroy(rwl);
+}
+
+/* -------- <FIFTH TEST END> -------- */
+
+/* -------- <SIXTH TEST START> -------- */
+
+#define POOL_SLAB_LOCKS_NO 4
+#define POOL_LOCKS_NO 10
+
+static void
+pool_rw_lock_test(void){
+    rw_lock *locks[POOL_LOCKS_NO], *recycled[POOL_LOCKS_NO];
+    rw_lock_attr attr;
+    rw_lock_pool *pool;
+    char name[16];
+    int i, j;
+    bool found;
+
+    prepare_assertion_failure();
+
+    /* Three slabs are required for the locks */
+    pool = rw_lock_pool_create(2, NULL, POOL_SLAB_LOCKS_NO);
+    rw_lock_pool_init_locks(pool, locks, POOL_LOCKS_NO);
+
+    for (i = 0; i < POOL_LOCKS_NO; i++){
+	my_assert("Check if the lock is aligned to the cache line",
+		  __FILE__, __LINE__, ((uintptr_t) locks[i] % 64) == 0);
+	rw_lock_wr_lock(locks[i]);
+    }
+    for (i = 0; i < POOL_LOCKS_NO; i++){
+	rw_lock_unlock(locks[i]);
+	rw_lock_rd_lock_owner(locks[i], READER_TASK_A);
+	rw_lock_rd_lock_owner(locks[i], READER_TASK_B);
+    }
+    for (i = 0; i < POOL_LOCKS_NO; i++){
+	rw_lock_unlock_owner(locks[i], READER_TASK_A);
+	rw_lock_unlock_owner(locks[i], READER_TASK_B);
+    }
+
+    rw_lock_destroy_locks(locks, POOL_LOCKS_NO);
+
+    /* The destroyed locks are recycled instead of new slabs */
+    rw_lock_pool_init_locks(pool, recycled, POOL_LOCKS_NO - 1);
+    recycled[POOL_LOCKS_NO - 1] = rw_lock_pool_init_lock(pool);
+    for (i = 0; i < POOL_LOCKS_NO; i++){
+	found = false;
+	for (j = 0; j < POOL_LOCKS_NO; j++){
+	    if (recycled[i] == locks[j])
+		found = true;
+	}
+	my_assert("Check if the lock is recycled from the pool",
+		  __FILE__, __LINE__, found);
+	my_assert("Check if the recycled lock is free",
+		  __FILE__, __LINE__, recycled[i]->running_threads_in_CS == 0);
+    }
+
+    for (i = 0; i < POOL_LOCKS_NO; i++)
+	rw_lock_destroy(recycled[i]);
+    rw_lock_pool_destroy(pool);
+
+    /* The pool keeps the class of its locks after the name is gone */
+    rw_lock_attr_init(&attr);
+    snprintf(name, sizeof(name), "pool class");
+    attr.lock_class = name;
+    pool = rw_lock_pool_create(2, &attr, POOL_SLAB_LOCKS_NO);
+    snprintf(name, sizeof(name), "reused name");
+    locks[0] = rw_lock_pool_init_lock(pool);
+    snprintf(name, sizeof(name), "reused again");
+    locks[1] = rw_lock_pool_init_lock(pool);
+    my_assert("Check if the pooled locks share the class",
+	      __FILE__, __LINE__,
+	      locks[0]->class_index >= 0 &&
+	      locks[0]->class_index == locks[1]->class_index);
+    rw_lock_destroy_locks(locks, 2);
+    rw_lock_pool_destroy(pool);
+}
+
+/* -------- <SIXTH TEST END> -------- */
+
+/* -------- <SEVENTH TEST START> -------- */
+
+#define CAPPED_READERS_NO 2
+#define QUEUED_READERS_NO 4
+
+static int capped_readers_order[QUEUED_READERS_NO];
+static int capped_readers_entered = 0;
+
+typedef struct capped_reader_data {
+    rw_lock *rwl;
+    int id;
+} capped_reader_data;
+
+static void *
+capped_reader_cb(void *arg){
+    capped_reader_data *data = (capped_reader_data *) arg;
+    int i;
+
+    rw_lock_rd_lock(data->rwl);
+    my_assert("Check if the readers in the C.S. are capped",
+	      __FILE__, __LINE__,
+	      data->rwl->running_threads_in_CS <= CAPPED_READERS_NO);
+    i = __atomic_fetch_add(&capped_readers_entered, 1, __ATOMIC_SEQ_CST);
+    capped_readers_order[i] = data->id;
+    rw_lock_unlock(data->rwl);
+
+    return NULL;
+}
+
+/* Take the only slot after the asynchronous reader queued later */
+static void *
+capped_blocking_reader_cb(void *arg){
+    rw_lock *rwl = (rw_lock *) arg;
+
+    rw_lock_rd_lock(rwl);
+    my_assert("Check if the asynchronous reader doesn't overtake the queued one",
+	      __FILE__, __LINE__, granted_count == 0);
+    rw_lock_unlock(rwl);
+
+    return NULL;
+}
+
+static void
+capped_rw_lock_test(void){
+    pthread_t handlers[QUEUED_READERS_NO];
+    capped_reader_data data[QUEUED_READERS_NO];
+    rw_lock_owner async_reader = READER_TASK_B;
+    rw_lock_attr attr;
+    rw_lock *rwl;
+    int i;
+
+    prepare_assertion_failure();
+
+    rw_lock_attr_init(&attr);
+    attr.max_readers = CAPPED_READERS_NO;
+    rwl = rw_lock_init_attr(QUEUED_READERS_NO + CAPPED_READERS_NO, &attr);
+
+    /* Take all the slots. The recursive read lock doesn't need another one */
+    rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+    rw_lock_rd_lock_owner(rwl, READER_TASK_B);
+    rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+    rw_lock_unlock_owner(rwl, READER_TASK_A);
+    my_assert("Check if the excess reader fails to take the lock",
+	      __FILE__, __LINE__, rw_lock_rd_trylock(rwl) == false);
+
+    /* Queue the readers one by one */
+    for (i = 0; i < QUEUED_READERS_NO; i++){
+	data[i].rwl = rwl;
+	data[i].id = i;
+	if (pthread_create(&handlers[i], NULL, capped_reader_cb, &data[i]) != 0){
+	    perror("pthread_create");
+	    exit(-1);
+	}
+	while(__atomic_load_n(&rwl->waiting_reader_threads, __ATOMIC_SEQ_CST) != i + 1)
+	    ;
+    }
+
+    /* Free one slot. The queued readers pass through it in FIFO order */
+    rw_lock_unlock_owner(rwl, READER_TASK_A);
+    for (i = 0; i < QUEUED_READERS_NO; i++)
+	pthread_join(handlers[i], NULL);
+
+    for (i = 0; i < QUEUED_READERS_NO; i++){
+	my_assert("Check if the capped readers are granted in FIFO order",
+		  __FILE__, __LINE__, capped_readers_order[i] == i);
+    }
+
+    /* A writer keeps the exclusive access */
+    my_assert("Check if the writer waits for the reader",
+	      __FILE__, __LINE__, rw_lock_wr_trylock(rwl) == false);
+    rw_lock_unlock_owner(rwl, READER_TASK_B);
+    my_assert("Check if the writer gets the lock after the reader left",
+	      __FILE__, __LINE__, rw_lock_wr_trylock(rwl) == true);
+    rw_lock_unlock(rwl);
+    rw_lock_destroy(rwl);
+
+    /* The blocking and the asynchronous readers share the FIFO order */
+    attr.max_readers = 1;
+    rwl = rw_lock_init_attr(2, &attr);
+    granted_count = 0;
+
+    rw_lock_rd_lock_owner(rwl, READER_TASK_A);
+    if (pthread_create(&handlers[0], NULL, capped_blocking_reader_cb, rwl) != 0){
+	perror("pthread_create");
+	exit(-1);
+    }
+    while(__atomic_load_n(&rwl->waiting_reader_threads, __ATOMIC_SEQ_CST) != 1)
+	;
+    my_assert("Check if the asynchronous reader is queued",
+	      __FILE__, __LINE__,
+	      !rw_lock_rd_lock_async(rwl, async_reader, async_granted_cb,
+				     &async_reader, -1));
+
+    rw_lock_unlock_owner(rwl, READER_TASK_A);
+    pthread_join(handlers[0], NULL);
+    my_assert("Check if the asynchronous reader follows the blocking one",
+	      __FILE__, __LINE__, granted_count == 1);
+    rw_lock_unlock_owner(rwl, async_reader);
+    rw_lock_destroy(rwl);
+}
+
+/* -------- <SEVENTH TEST END> -------- */
+
+/* -------- <EIGHTH TEST START> -------- */
+
+#define EPOCH_READERS_NO 4
+#define EPOCH_VERSIONS_NO 2000
+
+/* The fields are equal while the version is published */
+typedef struct epoch_version {
+    uint64_t values[2];
+    struct epoch_version *next_reclaimed;
+} epoch_version;
+
+static void *epoch_slot;
+static int epoch_readers_started = 0;
+static bool epoch_readers_stop = false;
+static epoch_version *epoch_reclaimed = NULL;
+static int epoch_reclaimed_no = 0;
+
+/*
+ * Break the version as if it was freed, and keep it to free at the end, so
+ * that a reader still seeing it notices that without touching freed memory.
+ */
+static void
+epoch_reclaim_cb(void *ptr, void *arg){
+    epoch_version *version = (epoch_version *) ptr;
+
+    version->values[0] = 0;
+    version->values[1] = UINT64_MAX;
+
+    pthread_mutex_lock((pthread_mutex_t *) arg);
+    version->next_reclaimed = epoch_reclaimed;
+    epoch_reclaimed = version;
+    epoch_reclaimed_no++;
+    pthread_mutex_unlock((pthread_mutex_t *) arg);
+}
+
+static void *
+epoch_reader_cb(void *arg){
+    rw_epoch_reader *reader = rw_epoch_register((rw_epoch_domain *) arg);
+    epoch_version *version;
+
+    __atomic_add_fetch(&epoch_readers_started, 1, __ATOMIC_SEQ_CST);
+    while(!__atomic_load_n(&epoch_readers_stop, __ATOMIC_RELAXED)){
+	rw_epoch_enter(reader);
+	version = (epoch_version *) rw_epoch_dereference(&epoch_slot);
+	my_assert("Check if the version is not reclaimed in the section",
+		  __FILE__, __LINE__, version->values[0] == version->values[1]);
+	/* The nested section keeps the same version alive */
+	rw_epoch_enter(reader);
+	rw_epoch_exit(reader);
+	sched_yield();
+	my_assert("Check if the version is not reclaimed in the section",
+		  __FILE__, __LINE__, version->values[0] == version->values[1]);
+	rw_epoch_exit(reader);
+    }
+
+    rw_epoch_unregister(reader);
+
+    return NULL;
+}
+
+static void
+epoch_rw_lock_test(void){
+    pthread_t handlers[EPOCH_READERS_NO];
+    pthread_mutex_t reclaimed_mutex = PTHREAD_MUTEX_INITIALIZER;
+    epoch_version *version, *old;
+    rw_epoch_domain *domain;
+    rw_lock *rwl;
+    int i;
+
+    prepare_assertion_failure();
+
+    rwl = rw_lock_init(1);
+    domain = rw_epoch_init(EPOCH_READERS_NO);
+
+    if ((version = (epoch_version *) calloc(1, sizeof(epoch_version))) == NULL){
+	perror("calloc");
+	exit(-1);
+    }
+    epoch_slot = version;
+
+    for (i = 0; i < EPOCH_READERS_NO; i++){
+	if (pthread_create(&handlers[i], NULL, epoch_reader_cb, domain) != 0){
+	    perror("pthread_create");
+	    exit(-1);
+	}
+    }
+    while(__atomic_load_n(&epoch_readers_started, __ATOMIC_SEQ_CST) != EPOCH_READERS_NO)
+	;
+
+    for (i = 1; i <= EPOCH_VERSIONS_NO; i++){
+	if ((version = (epoch_version *) calloc(1, sizeof(epoch_version))) == NULL){
+	    perror("calloc");
+	    exit(-1);
+	}
+	version->values[0] = version->values[1] = i;
+
+	rw_lock_wr_lock(rwl);
+	old = (epoch_version *) rw_epoch_publish(&epoch_slot, version);
+	rw_lock_unlock(rwl);
+
+	/* Retire the old versions both synchronously and asynchronously */
+	if (i % 2 == 0){
+	    rw_epoch_defer(domain, old, epoch_reclaim_cb, &reclaimed_mutex);
+	}else{
+	    rw_epoch_synchronize(domain);
+	    epoch_reclaim_cb(old, &reclaimed_mutex);
+	}
+    }
+
+    __atomic_store_n(&epoch_readers_stop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < EPOCH_READERS_NO; i++)
+	pthread_join(handlers[i], NULL);
+
+    rw_epoch_destroy(domain);
+    my_assert("Check if all the old versions have been reclaimed",
+	      __FILE__, __LINE__, epoch_reclaimed_no == EPOCH_VERSIONS_NO);
+
+    while((old = epoch_reclaimed) != NULL){
+	epoch_reclaimed = old->next_reclaimed;
+	free(old);
+    }
+    free(epoch_slot);
+    rw_lock_destroy(rwl);
+}
+
+/* -------- <EIGHTH TEST END> -------- */
+
 int
 main(int argc, char **argv){
 
@@ -281,6 +896,26 @@ main(int argc, char **argv){
     printf("<Tests for recursive rw-locks>\n");
     rec_rw_threads_test();
 
+    printf("<Tests for asynchronous rw-locks>\n");
+    async_rw_lock_test();
+
+    printf("<Tests for rw-locks owned by a task>\n");
+    owner_handoff_test();
+    validated_owner_handoff_test();
+    validated_thread_release_test();
+
+    printf("<Tests for adaptive rw-locks>\n");
+    adaptive_rw_lock_test();
+
+    printf("<Tests for pooled rw-locks>\n");
+    pool_rw_lock_test();
+
+    printf("<Tests for rw-locks with capped readers>\n");
+    capped_rw_lock_test();
+
+    printf("<Tests for epoch-based reclamation with rw-locks>\n");
+    epoch_rw_lock_test();
+
     pthread_exit(0);
 
     return 0;
@@ -10,6 +10,8 @@
 /* For debugging tests */
 static sigjmp_buf env;
 static bool expected_failure_raised;
+/* Return from the handler as if the failure were ignored */
+static bool return_from_handler;
 
 /*
  * All execution units need to register signal handler 'assert_dump_handler'
@@ -23,7 +25,8 @@ assert_dump_handler(int sig, siginfo_t *info, void *q){
 
     expected_failure_raised = true;
 
-    siglongjmp(env, 1);
+    if (!return_from_handler)
+	siglongjmp(env, 1);
 }
 
 void
@@ -90,6 +93,132 @@ test_destory_rwl_with_lock(){
     }
 }
 
+static void
+test_lock_order_inversion(){
+    rw_lock_attr attr;
+    rw_lock *rwl_a, *rwl_a2, *rwl_b;
+    char name[16];
+
+    rw_lock_attr_init(&attr);
+    attr.lock_class = "lock A";
+    rwl_a = rw_lock_init_attr(1, &attr);
+    attr.lock_class = "lock B";
+    rwl_b = rw_lock_init_attr(1, &attr);
+
+    /* Another lock of the class A, named at runtime */
+    snprintf(name, sizeof(name), "lock %c", 'A');
+    attr.lock_class = name;
+    rwl_a2 = rw_lock_init_attr(1, &attr);
+    name[0] = '\0';
+
+    if (sigsetjmp(env, 1) == 0){
+	/*
+	 * <Scenario 4>
+	 *
+	 * The locks are taken in the order of A and B, then in the reverse
+	 * order, where A is another lock of the same class. The validator
+	 * detects the potential deadlock without any other thread.
+	 */
+	rw_lock_rd_lock(rwl_a);
+	rw_lock_wr_lock(rwl_b);
+	rw_lock_unlock(rwl_b);
+	rw_lock_unlock(rwl_a);
+
+	rw_lock_rd_lock(rwl_b);
+	rw_lock_wr_lock(rwl_a2);
+    }else{
+	if (!expected_failure_raised){
+	    printf("NG : [%s] The expected assertion failure doesn't work\n",
+		   __FUNCTION__);
+	    exit(-1);
+	}else{
+	    printf("OK : [%s] The expected assertion failure works\n",
+		   __FUNCTION__);
+	    /* The failure is raised before waiting for the lock A */
+	    rw_lock_unlock(rwl_b);
+	    rw_lock_destroy(rwl_a);
+	    rw_lock_destroy(rwl_a2);
+	    rw_lock_destroy(rwl_b);
+	}
+    }
+}
+
+static void
+test_lock_upgrade(){
+    rw_lock_attr attr;
+    rw_lock *rwl;
+
+    rw_lock_attr_init(&attr);
+    attr.lock_class = "upgraded lock";
+    rwl = rw_lock_init_attr(1, &attr);
+
+    if (sigsetjmp(env, 1) == 0){
+	/*
+	 * <Scenario 5>
+	 *
+	 * The read lock holder requests the write lock, which would wait for
+	 * the holder itself.
+	 */
+	rw_lock_rd_lock(rwl);
+	rw_lock_wr_lock(rwl);
+    }else{
+	if (!expected_failure_raised){
+	    printf("NG : [%s] The expected assertion failure doesn't work\n",
+		   __FUNCTION__);
+	    exit(-1);
+	}else{
+	    printf("OK : [%s] The expected assertion failure works\n",
+		   __FUNCTION__);
+	    rw_lock_unlock(rwl);
+	    rw_lock_destroy(rwl);
+	}
+    }
+}
+
+static void
+test_destroy_locks_in_use(){
+    rw_lock_pool *pool;
+    rw_lock *locks[2], *rwl;
+
+    /*
+     * <Scenario 6>
+     *
+     * The locks are destroyed at once while one of them is still held, and
+     * the failure handler returns. None of the locks is destroyed or
+     * returned to the pool.
+     */
+    pool = rw_lock_pool_create(1, NULL, 4);
+    rw_lock_pool_init_locks(pool, locks, 2);
+
+    rw_lock_rd_lock(locks[1]);
+    return_from_handler = true;
+    rw_lock_destroy_locks(locks, 2);
+    return_from_handler = false;
+
+    if (!expected_failure_raised){
+	printf("NG : [%s] The expected assertion failure doesn't work\n",
+	       __FUNCTION__);
+	exit(-1);
+    }
+
+    rwl = rw_lock_pool_init_lock(pool);
+    if (rwl == locks[0] || rwl == locks[1]){
+	printf("NG : [%s] The lock in use has been returned to the pool\n",
+	       __FUNCTION__);
+	exit(-1);
+    }
+
+    rw_lock_unlock(locks[1]);
+    rw_lock_wr_lock(locks[0]);
+    rw_lock_unlock(locks[0]);
+    printf("OK : [%s] The expected assertion failure works\n",
+	   __FUNCTION__);
+
+    rw_lock_destroy(rwl);
+    rw_lock_destroy_locks(locks, 2);
+    rw_lock_pool_destroy(pool);
+}
+
 /* <Scenario 3 > */
 /*
  * Step1 : T1_flag and T2_flag gets updated to true by T1 and T2 after their read locks.
@@ -243,6 +372,22 @@ main(int argc, char **argv){
     expected_failure_raised = false;
     test_destory_rwl_with_lock();
 
+    printf("--- <Scenario 4> ---\n");
+    prepare_assertion_failure();
+    expected_failure_raised = false;
+    test_lock_order_inversion();
+
+    printf("--- <Scenario 5> ---\n");
+    prepare_assertion_failure();
+    expected_failure_raised = false;
+    test_lock_upgrade();
+
+    printf("--- <Scenario 6> ---\n");
+    prepare_assertion_failure();
+    expected_failure_raised = false;
+    test_destroy_locks_in_use();
+
+    /* Scenario 3 exits the main thread, so it runs at the end */
     printf("--- <Scenario 3> ---\n");
     prepare_assertion_failure();
     expected_failure_raised = false;
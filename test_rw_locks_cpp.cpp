@@ -0,0 +1,205 @@
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+#include "rw_locks.hpp"
+
+/*
+ * Tests of the C++ wrappers in rw_locks.hpp.
+ */
+
+#define THREADS_TOTAL_NO 8
+#define LOOPS_NO 2000
+/* More than the owners a recursive_shared_mutex tracks */
+#define MANY_READERS_NO 70
+
+using counting_shared_mutex =
+    rw_locks::basic_shared_mutex<rw_locks::policy<rw_locks::fairness::prefer_writers,
+						  16, true, true>>;
+
+/* The disabled features must not cost any space */
+static_assert(sizeof(rw_locks::shared_mutex) == sizeof(rw_lock *),
+	      "The disabled policies should leave no data behind");
+static_assert(!std::is_copy_constructible<rw_locks::shared_mutex>::value &&
+	      !std::is_move_constructible<rw_locks::shared_mutex>::value,
+	      "SharedMutex is neither copyable nor movable");
+
+static void
+assert_dump_handler(int sig){
+    static const char msg[] = "\n!!! the C++ test raised assertion failure\n\n";
+
+    write(STDERR_FILENO, msg, sizeof(msg));
+    _exit(-1);
+}
+
+/*
+ * Let the readers and the writers update two values which must be equal
+ * whenever the shared lock is held.
+ */
+template <class SharedMutex>
+static void
+readers_writers_test(void){
+    SharedMutex mtx;
+    std::vector<std::thread> threads;
+    long values[2] = {0, 0};
+
+    for (int i = 0; i < THREADS_TOTAL_NO; i++){
+	threads.emplace_back([&mtx, &values, i]{
+	    for (int j = 0; j < LOOPS_NO; j++){
+		if ((i + j) % 4 == 0){
+		    std::unique_lock<SharedMutex> lock(mtx);
+		    values[0]++;
+		    values[1]++;
+		}else{
+		    std::shared_lock<SharedMutex> lock(mtx);
+		    my_assert("Check if the writer is excluded",
+			      __FILE__, __LINE__, values[0] == values[1]);
+		}
+	    }
+	});
+    }
+
+    for (auto &t : threads)
+	t.join();
+
+    my_assert("Check if all the writes have been done",
+	      __FILE__, __LINE__,
+	      values[0] == THREADS_TOTAL_NO * LOOPS_NO / 4);
+}
+
+/*
+ * The default shared_mutex has no limit of the readers sharing it.
+ */
+static void
+many_readers_test(void){
+    rw_locks::shared_mutex mtx;
+    std::vector<std::thread> threads;
+    std::atomic<int> readers{0};
+
+    for (int i = 0; i < MANY_READERS_NO; i++){
+	threads.emplace_back([&mtx, &readers]{
+	    std::shared_lock<rw_locks::shared_mutex> lock(mtx);
+
+	    /* Keep holding the lock until all the readers share it */
+	    readers++;
+	    while(readers.load() < MANY_READERS_NO)
+		std::this_thread::yield();
+	});
+    }
+
+    for (auto &t : threads)
+	t.join();
+
+    my_assert("Check if the writer gets the lock after the readers left",
+	      __FILE__, __LINE__, mtx.try_lock());
+    mtx.unlock();
+}
+
+static void
+recursive_lock_test(void){
+    rw_locks::recursive_shared_mutex mtx;
+
+    std::unique_lock<rw_locks::recursive_shared_mutex> outer(mtx);
+    {
+	std::unique_lock<rw_locks::recursive_shared_mutex> inner(mtx);
+	my_assert("Check if the writer recurses",
+		  __FILE__, __LINE__,
+		  mtx.native_handle()->writer_recursive_count == 2);
+    }
+    outer.unlock();
+
+    std::shared_lock<rw_locks::recursive_shared_mutex> reader(mtx);
+    my_assert("Check if the recursive reader gets the lock",
+	      __FILE__, __LINE__, mtx.try_lock_shared());
+    mtx.unlock_shared();
+}
+
+static void
+timed_lock_test(void){
+    counting_shared_mutex mtx;
+    std::unique_lock<counting_shared_mutex> writer(mtx);
+
+    std::thread([&mtx]{
+	my_assert("Check if the write lock times out",
+		  __FILE__, __LINE__,
+		  !mtx.try_lock_for(std::chrono::milliseconds(10)));
+	my_assert("Check if the read lock times out",
+		  __FILE__, __LINE__,
+		  !mtx.try_lock_shared_until(std::chrono::steady_clock::now() +
+					     std::chrono::milliseconds(10)));
+    }).join();
+
+    writer.unlock();
+
+    std::thread([&mtx]{
+	std::shared_lock<counting_shared_mutex> reader(mtx, std::chrono::seconds(1));
+
+	my_assert("Check if the read lock is taken before the timeout",
+		  __FILE__, __LINE__, reader.owns_lock());
+    }).join();
+
+    rw_locks::lock_stats stats = mtx.stats();
+    my_assert("Check if the acquisitions are counted",
+	      __FILE__, __LINE__,
+	      stats.exclusive_acquisitions == 1 && stats.shared_acquisitions == 1);
+}
+
+/*
+ * A writer timing out must not keep holding back the readers which wait
+ * for it under the writer preference.
+ */
+static void
+timed_writer_timeout_test(void){
+    counting_shared_mutex mtx;
+    std::shared_lock<counting_shared_mutex> reader(mtx);
+
+    std::thread writer([&mtx]{
+	my_assert("Check if the write lock times out",
+		  __FILE__, __LINE__,
+		  !mtx.try_lock_for(std::chrono::milliseconds(200)));
+    });
+    while(__atomic_load_n(&mtx.native_handle()->waiting_writer_threads,
+			  __ATOMIC_SEQ_CST) == 0)
+	std::this_thread::yield();
+
+    /* Waits for the writer, then gets the lock after the writer gives up */
+    std::thread([&mtx]{
+	auto start = std::chrono::steady_clock::now();
+	std::shared_lock<counting_shared_mutex> other(mtx, std::chrono::seconds(2));
+
+	/* The timed read lock rechecks the lock at its deadline anyway */
+	my_assert("Check if the reader gets the lock after the writer's timeout",
+		  __FILE__, __LINE__,
+		  other.owns_lock() &&
+		  std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    }).join();
+
+    writer.join();
+}
+
+int
+main(int argc, char **argv){
+    signal(SIGUSR1, assert_dump_handler);
+
+    printf("<Tests for the C++ shared mutexes>\n");
+    readers_writers_test<rw_locks::shared_mutex>();
+    readers_writers_test<rw_locks::recursive_shared_mutex>();
+    readers_writers_test<counting_shared_mutex>();
+
+    printf("<Tests for the C++ shared mutex shared by many readers>\n");
+    many_readers_test();
+
+    printf("<Tests for the recursive C++ shared mutex>\n");
+    recursive_lock_test();
+
+    printf("<Tests for the timed C++ shared mutex>\n");
+    timed_lock_test();
+    timed_writer_timeout_test();
+
+    return 0;
+}
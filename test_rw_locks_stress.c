@@ -0,0 +1,549 @@
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rw_locks.h"
+
+/*
+ * Stress and latency-regression harness.
+ *
+ * Run the given numbers of threads against one rw_lock for a fixed duration
+ * with random read/write, recursive, try and timed lock operations. Verify
+ * the reader/writer invariant on every entry to the C.S., then compare the
+ * throughput and the p99 acquisition latency with the stored baseline.
+ *
+ * The results are written to stderr.
+ */
+
+#define MAX_CONFIGS 16
+#define MAX_BASELINE_RECORDS 256
+#define MAX_RECURSION 3
+/* Log-linear latency histogram with 8 sub-buckets per power of two */
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+#define TIMED_LOCK_NSEC (1000 * 1000)
+
+typedef struct stress_config {
+    int threads[MAX_CONFIGS];
+    int configs_no;
+    int read_pct;
+    int duration_sec;
+    int tolerance_pct;
+    bool adaptive;
+    unsigned int max_readers;
+    char *baseline_path;
+    bool write_baseline;
+} stress_config;
+
+typedef struct stress_result {
+    int threads;
+    int read_pct;
+    double throughput;
+    uint64_t p99_ns;
+} stress_result;
+
+typedef struct thread_unique {
+    /* Data hold by each thread */
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t failed_attempts;
+    uint64_t latency_histogram[LATENCY_BUCKETS];
+    /* Data shared among all the threads */
+    rw_lock *rwl;
+    int read_pct;
+} thread_unique;
+
+/* Shared invariant checker */
+static atomic_int readers_in_CS;
+static atomic_int writers_in_CS;
+static atomic_bool stop_stress;
+static unsigned int max_readers_in_CS;
+static pthread_barrier_t start_barrier;
+
+/* Updated by writers and verified by readers */
+static volatile uint64_t shared_data[2];
+
+/*
+ * All threads need to register signal handler 'assert_dump_handler'
+ * for debugging via 'prepare_assertion_failure'.
+ *
+ * Depend on async-signal-safe functions only.
+ */
+void
+assert_dump_handler(int sig, siginfo_t *info, void *q){
+    char msg[] = "\n!!! the stress test raised assertion failure\n\n";
+
+    write(STDERR_FILENO, msg, sizeof(msg));
+
+    _exit(-1);
+}
+
+void
+prepare_assertion_failure(void){
+    struct sigaction act;
+
+    act.sa_sigaction = assert_dump_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+
+    if (sigaction(SIGUSR1, &act, NULL) != 0){
+	perror("sigaction");
+	exit(-1);
+    }
+}
+
+static uint64_t
+now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+checker_enter(rw_lock_mode mode){
+    if (mode == RW_LOCK_READ){
+	my_assert("The readers are capped", __FILE__, __LINE__,
+		  atomic_fetch_add(&readers_in_CS, 1) < max_readers_in_CS ||
+		  max_readers_in_CS == 0);
+	my_assert("No reader overlaps a writer", __FILE__, __LINE__,
+		  atomic_load(&writers_in_CS) == 0);
+	my_assert("The shared data is consistent for readers", __FILE__, __LINE__,
+		  shared_data[0] == shared_data[1]);
+    }else{
+	my_assert("Writer exclusivity against other writers", __FILE__, __LINE__,
+		  atomic_fetch_add(&writers_in_CS, 1) == 0);
+	my_assert("Writer exclusivity against readers", __FILE__, __LINE__,
+		  atomic_load(&readers_in_CS) == 0);
+	shared_data[0]++;
+	shared_data[1]++;
+    }
+}
+
+static void
+checker_exit(rw_lock_mode mode){
+    if (mode == RW_LOCK_READ)
+	atomic_fetch_sub(&readers_in_CS, 1);
+    else
+	atomic_fetch_sub(&writers_in_CS, 1);
+}
+
+/*
+ * Map the latency to its histogram bucket. The error of the bucket's lower
+ * bound is less than 1/8 of the latency.
+ */
+static int
+latency_to_bucket(uint64_t latency){
+    int msb;
+
+    if (latency < LATENCY_SUB_BUCKETS)
+	return latency;
+
+    msb = 63 - __builtin_clzll(latency);
+
+    return (msb - 2) * LATENCY_SUB_BUCKETS +
+	((latency >> (msb - 3)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t
+bucket_to_latency(int bucket){
+    int msb = bucket / LATENCY_SUB_BUCKETS + 2;
+
+    if (bucket < LATENCY_SUB_BUCKETS)
+	return bucket;
+
+    return (uint64_t) (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (msb - 3);
+}
+
+static void
+record_latency(thread_unique *unique, uint64_t latency){
+    unique->latency_histogram[latency_to_bucket(latency)]++;
+}
+
+static bool
+stress_acquire(thread_unique *unique, rw_lock_mode mode){
+    struct timespec abstime;
+    int kind = rand_r(&unique->seed) % 10;
+
+    if (kind == 0){
+	return mode == RW_LOCK_READ ? rw_lock_rd_trylock(unique->rwl) :
+	    rw_lock_wr_trylock(unique->rwl);
+    }else if (kind == 1){
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_nsec += TIMED_LOCK_NSEC;
+	if (abstime.tv_nsec >= 1000000000L){
+	    abstime.tv_sec++;
+	    abstime.tv_nsec -= 1000000000L;
+	}
+	return mode == RW_LOCK_READ ? rw_lock_rd_timedlock(unique->rwl, &abstime) :
+	    rw_lock_wr_timedlock(unique->rwl, &abstime);
+    }else{
+	if (mode == RW_LOCK_READ)
+	    rw_lock_rd_lock(unique->rwl);
+	else
+	    rw_lock_wr_lock(unique->rwl);
+	return true;
+    }
+}
+
+static void *
+stress_thread_cb(void *arg){
+    thread_unique *unique = (thread_unique *) arg;
+    rw_lock_mode mode;
+    uint64_t start;
+    int depth, i;
+
+    pthread_barrier_wait(&start_barrier);
+
+    while(!atomic_load_explicit(&stop_stress, memory_order_relaxed)){
+	mode = rand_r(&unique->seed) % 100 < unique->read_pct ?
+	    RW_LOCK_READ : RW_LOCK_WRITE;
+
+	start = now_ns();
+	if (!stress_acquire(unique, mode)){
+	    unique->failed_attempts++;
+	    continue;
+	}
+	record_latency(unique, now_ns() - start);
+
+	checker_enter(mode);
+
+	/* Inject the recursive locks, which must never fail nor wait */
+	depth = rand_r(&unique->seed) % 4 == 0 ?
+	    rand_r(&unique->seed) % MAX_RECURSION + 1 : 0;
+	for (i = 0; i < depth; i++){
+	    my_assert("The recursive lock is available to the holder",
+		      __FILE__, __LINE__,
+		      mode == RW_LOCK_READ ? rw_lock_rd_trylock(unique->rwl) :
+		      rw_lock_wr_trylock(unique->rwl));
+	}
+	if (mode == RW_LOCK_WRITE){
+	    my_assert("The recursive count matches the writer's locks",
+		      __FILE__, __LINE__,
+		      unique->rwl->writer_recursive_count == depth + 1);
+	}
+	for (i = 0; i < depth; i++)
+	    rw_lock_unlock(unique->rwl);
+
+	/* The recursive unlocks keep holding the lock */
+	checker_exit(mode);
+	checker_enter(mode);
+
+	checker_exit(mode);
+	rw_lock_unlock(unique->rwl);
+
+	unique->ops++;
+    }
+
+    return NULL;
+}
+
+static void
+run_stress(stress_config *config, int threads, stress_result *result){
+    pthread_t *handlers;
+    thread_unique *uniques;
+    uint64_t histogram[LATENCY_BUCKETS] = { 0 }, ops = 0, failed = 0,
+	samples = 0, cumulative = 0, start, elapsed;
+    int i, j;
+    rw_lock_attr attr;
+    rw_lock *rwl;
+
+    if ((handlers = malloc(sizeof(pthread_t) * threads)) == NULL ||
+	(uniques = malloc(sizeof(thread_unique) * threads)) == NULL){
+	perror("malloc");
+	exit(-1);
+    }
+
+    rw_lock_attr_init(&attr);
+    attr.adaptive = config->adaptive;
+    attr.max_readers = config->max_readers;
+    max_readers_in_CS = config->max_readers;
+    rwl = rw_lock_init_attr(threads, &attr);
+    atomic_store(&stop_stress, false);
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+
+    for (i = 0; i < threads; i++){
+	memset(&uniques[i], 0, sizeof(thread_unique));
+	uniques[i].seed = i + 1;
+	uniques[i].rwl = rwl;
+	uniques[i].read_pct = config->read_pct;
+	if (pthread_create(&handlers[i], NULL,
+			   stress_thread_cb, (void *) &uniques[i]) != 0){
+	    perror("pthread_create");
+	    exit(-1);
+	}
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    sleep(config->duration_sec);
+    atomic_store(&stop_stress, true);
+
+    for (i = 0; i < threads; i++)
+	pthread_join(handlers[i], NULL);
+    elapsed = now_ns() - start;
+
+    /* Recursion balance : nothing must be left in the C.S. */
+    my_assert("No thread is left in the checker", __FILE__, __LINE__,
+	      atomic_load(&readers_in_CS) == 0 && atomic_load(&writers_in_CS) == 0);
+    my_assert("The lock is free after the stress", __FILE__, __LINE__,
+	      rw_lock_wr_trylock(rwl));
+    rw_lock_unlock(rwl);
+    rw_lock_destroy(rwl);
+
+    for (i = 0; i < threads; i++){
+	ops += uniques[i].ops;
+	failed += uniques[i].failed_attempts;
+	for (j = 0; j < LATENCY_BUCKETS; j++){
+	    histogram[j] += uniques[i].latency_histogram[j];
+	    samples += uniques[i].latency_histogram[j];
+	}
+    }
+
+    /* Find the bucket where the 99th percentile sample falls */
+    result->p99_ns = 0;
+    for (j = 0; j < LATENCY_BUCKETS && samples > 0; j++){
+	cumulative += histogram[j];
+	if (cumulative * 100 >= samples * 99){
+	    result->p99_ns = bucket_to_latency(j);
+	    break;
+	}
+    }
+
+    result->threads = threads;
+    result->read_pct = config->read_pct;
+    result->throughput = (double) ops * 1000000000.0 / elapsed;
+
+    fprintf(stderr, "threads = %d, read = %d%% : %.0f ops/s, p99 = %lu ns (%lu failed try/timed attempts)\n",
+	    threads, config->read_pct, result->throughput,
+	    (unsigned long) result->p99_ns, (unsigned long) failed);
+
+    pthread_barrier_destroy(&start_barrier);
+    free(uniques);
+    free(handlers);
+}
+
+/*
+ * The baseline file has one line of
+ * "<adaptive> <max_readers> <threads> <read_pct> <ops/s> <p99_ns>" per
+ * configuration, so that the lock modes are compared with their own
+ * baselines.
+ */
+typedef struct baseline_record {
+    int adaptive;
+    unsigned int max_readers;
+    stress_result result;
+} baseline_record;
+
+static bool
+read_baseline_record(FILE *fp, baseline_record *record){
+    return fscanf(fp, "%d %u %d %d %lf %lu", &record->adaptive, &record->max_readers,
+		  &record->result.threads, &record->result.read_pct,
+		  &record->result.throughput,
+		  (unsigned long *) &record->result.p99_ns) == 6;
+}
+
+static bool
+baseline_record_matches(stress_config *config, baseline_record *record,
+			stress_result *result){
+    return record->adaptive == config->adaptive &&
+	record->max_readers == config->max_readers &&
+	record->result.threads == result->threads &&
+	record->result.read_pct == result->read_pct;
+}
+
+/*
+ * Return false if the result regressed beyond the tolerance.
+ */
+static bool
+check_baseline(stress_config *config, stress_result *result){
+    baseline_record record;
+    stress_result *base = &record.result;
+    FILE *fp;
+    bool ok = true, found = false;
+
+    if ((fp = fopen(config->baseline_path, "r")) == NULL){
+	fprintf(stderr, "NG : no baseline '%s' to compare with\n", config->baseline_path);
+	return false;
+    }
+
+    while(read_baseline_record(fp, &record)){
+	if (!baseline_record_matches(config, &record, result))
+	    continue;
+	found = true;
+
+	if (result->throughput <
+	    base->throughput * (100 - config->tolerance_pct) / 100){
+	    fprintf(stderr, "NG : throughput regressed from %.0f to %.0f ops/s\n",
+		    base->throughput, result->throughput);
+	    ok = false;
+	}
+	if (result->p99_ns >
+	    base->p99_ns * (100 + config->tolerance_pct) / 100){
+	    fprintf(stderr, "NG : p99 latency regressed from %lu to %lu ns\n",
+		    (unsigned long) base->p99_ns, (unsigned long) result->p99_ns);
+	    ok = false;
+	}
+    }
+
+    fclose(fp);
+
+    if (!found){
+	fprintf(stderr, "NG : no baseline of adaptive = %d, max_readers = %u, "
+		"threads = %d, read = %d%% in '%s'\n",
+		config->adaptive, config->max_readers,
+		result->threads, result->read_pct, config->baseline_path);
+	ok = false;
+    }
+
+    return ok;
+}
+
+/*
+ * Record the results, keeping the baselines of the other configurations in
+ * the file.
+ */
+static void
+write_baseline(stress_config *config, stress_result *results){
+    baseline_record *kept, record;
+    int kept_no = 0, i;
+    bool replaced;
+    FILE *fp;
+
+    if ((kept = (baseline_record *) malloc(sizeof(baseline_record) *
+					   MAX_BASELINE_RECORDS)) == NULL){
+	perror("malloc");
+	exit(-1);
+    }
+
+    if ((fp = fopen(config->baseline_path, "r")) != NULL){
+	while(kept_no < MAX_BASELINE_RECORDS && read_baseline_record(fp, &record)){
+	    replaced = false;
+	    for (i = 0; i < config->configs_no && !replaced; i++)
+		replaced = baseline_record_matches(config, &record, &results[i]);
+	    if (!replaced)
+		kept[kept_no++] = record;
+	}
+	fclose(fp);
+    }
+
+    if ((fp = fopen(config->baseline_path, "w")) == NULL){
+	perror("fopen");
+	exit(-1);
+    }
+
+    for (i = 0; i < kept_no; i++){
+	fprintf(fp, "%d %u %d %d %.0f %lu\n", kept[i].adaptive, kept[i].max_readers,
+		kept[i].result.threads, kept[i].result.read_pct,
+		kept[i].result.throughput, (unsigned long) kept[i].result.p99_ns);
+    }
+    for (i = 0; i < config->configs_no; i++){
+	fprintf(fp, "%d %u %d %d %.0f %lu\n", config->adaptive, config->max_readers,
+		results[i].threads, results[i].read_pct,
+		results[i].throughput, (unsigned long) results[i].p99_ns);
+    }
+
+    fclose(fp);
+    free(kept);
+}
+
+static void
+usage(char *program){
+    fprintf(stderr,
+	    "Usage: %s [-t threads[,threads...]] [-r read_pct] [-d seconds] [-a | -c max_readers]\n"
+	    "          [-b baseline_file [-w] [-T tolerance_pct]]\n", program);
+    exit(-1);
+}
+
+static void
+parse_threads(stress_config *config, char *arg, char *program){
+    char *token;
+
+    config->configs_no = 0;
+    for (token = strtok(arg, ","); token != NULL; token = strtok(NULL, ",")){
+	if (config->configs_no == MAX_CONFIGS || atoi(token) <= 0)
+	    usage(program);
+	config->threads[config->configs_no++] = atoi(token);
+    }
+}
+
+int
+main(int argc, char **argv){
+    stress_config config = {
+	.threads = { 8 },
+	.configs_no = 1,
+	.read_pct = 80,
+	.duration_sec = 2,
+	.tolerance_pct = 20,
+	.adaptive = false,
+	.max_readers = 0,
+	.baseline_path = NULL,
+	.write_baseline = false,
+    };
+    stress_result results[MAX_CONFIGS];
+    bool ok = true;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "t:r:d:ac:b:wT:")) != -1){
+	switch(opt){
+	    case 't':
+		parse_threads(&config, optarg, argv[0]);
+		break;
+	    case 'r':
+		config.read_pct = atoi(optarg);
+		break;
+	    case 'd':
+		config.duration_sec = atoi(optarg);
+		break;
+	    case 'a':
+		config.adaptive = true;
+		break;
+	    case 'c':
+		config.max_readers = atoi(optarg);
+		break;
+	    case 'b':
+		config.baseline_path = optarg;
+		break;
+	    case 'w':
+		config.write_baseline = true;
+		break;
+	    case 'T':
+		config.tolerance_pct = atoi(optarg);
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+
+    if (config.read_pct < 0 || config.read_pct > 100 ||
+	config.duration_sec <= 0 || config.tolerance_pct < 0 ||
+	(config.adaptive && config.max_readers > 0) ||
+	(config.write_baseline && config.baseline_path == NULL))
+	usage(argv[0]);
+
+    /* Don't spend the whole run to find that there is nothing to compare */
+    if (config.baseline_path != NULL && !config.write_baseline &&
+	access(config.baseline_path, R_OK) != 0){
+	fprintf(stderr, "NG : no baseline '%s' to compare with\n", config.baseline_path);
+	return 1;
+    }
+
+    prepare_assertion_failure();
+
+    for (i = 0; i < config.configs_no; i++){
+	run_stress(&config, config.threads[i], &results[i]);
+	if (config.baseline_path != NULL && !config.write_baseline &&
+	    !check_baseline(&config, &results[i]))
+	    ok = false;
+    }
+
+    if (config.write_baseline)
+	write_baseline(&config, results);
+
+    return ok ? 0 : 1;
+}